@@ -4,6 +4,8 @@
 //#include <GEO/GEO_Point.h>
 #include <SOP/SOP_Node.h>
 #include "fluid_system.h"
+#include "fluid_cache.h"
+#include "fluid_bake.h"
 
 class SOP_Fluid : public SOP_Node {
 public:
@@ -25,8 +27,18 @@ protected:
 
     // callback used by the "Clear All" parameter
     static int simulate(void* op, int index, fpreal time, const PRM_Template*);
+    // stops a background bake, frames already written stay in the cache
+    static int cancelBake(void* op, int index, fpreal time, const PRM_Template*);
+    // restarts the bake from the newest checkpoint at or before the current frame
+    static int resumeBake(void* op, int index, fpreal time, const PRM_Template*);
     OP_ERROR buildGeo();
+    // solver timings and counters in the info window
+    virtual void getNodeSpecificInfoText(OP_Context& context, OP_NodeInfoParms& iparms);
 private:
+    // stats of the bake as h2o_* detail attributes
+    void addStatsAttributes(const SolverStats& stats);
+    // opens or closes the trace file named by the traceFile parameter
+    void UpdateTrace(fpreal t);
 	// functions to constantly update the cook function, get the current value that the node has
     //exint MAX_PTS(exint t) { return evalFloat("maxPts", 0, t); }
 
@@ -35,12 +47,35 @@ private:
     fpreal ARTIFICIAL_PRESSURE(fpreal t) { return evalFloat("artificialPressure", 0, t); }
     fpreal VISCOSITY(fpreal t) { return evalFloat("viscosity", 0, t); }
     fpreal VORTICITY_CONFINEMENT(fpreal t) { return evalFloat("vorticityConfinement", 0, t); }
+    exint THREADS(exint t) { return evalInt("threads", 0, t); }
+    exint GRID_TYPE(exint t) { return evalInt("gridType", 0, t); }
+    bool BOUNDARY(fpreal t) { return evalInt("boundary", 0, t) != 0; }
+    exint PRECISION(exint t) { return evalInt("precision", 0, t); }
+    exint KERNEL(exint t) { return evalInt("kernel", 0, t); }
+    exint SOLVE_MODE(exint t) { return evalInt("solveMode", 0, t); }
+    void CACHE_FILE(UT_String& path, fpreal t) { evalString(path, "cacheFile", 0, t); }
+    exint CACHE_ENCODING(exint t) { return evalInt("cacheEncoding", 0, t); }
+    bool CACHE_DELTA(fpreal t) { return evalInt("cacheDelta", 0, t) != 0; }
+    fpreal CACHE_TOLERANCE(fpreal t) { return evalFloat("cacheTolerance", 0, t); }
+    exint CHECKPOINT_INTERVAL(exint t) { return evalInt("checkpointInterval", 0, t); }
+    void TRACE_FILE(UT_String& path, fpreal t) { evalString(path, "traceFile", 0, t); }
+    fpreal DENSITY_TOLERANCE(fpreal t) { return evalFloat("densityTolerance", 0, t); }
+    bool WARM_START(fpreal t) { return evalInt("warmStart", 0, t) != 0; }
+    fpreal WARM_DAMPING(fpreal t) { return evalFloat("warmDamping", 0, t); }
+    bool ADAPTIVE_STEP(fpreal t) { return evalInt("adaptiveStep", 0, t) != 0; }
+    fpreal CFL(fpreal t) { return evalFloat("cfl", 0, t); }
     //exint START_FRAME(exint t) { return evalInt("startFrame", 0, t); }
 
     glm::dvec3 force;
     bool validFluidPs;
     int frameRange;
     int iters;
+    int threads;
+    int gridType;
+    bool boundary;
+    int precision;
+    int kernel;
+    int solveMode;
     //int     myStartFrame;
     float kcorr;
     float viscosity;
@@ -51,7 +86,30 @@ private:
 
     OP_Context* myContext;
     FluidSystem* myFS;
-    std::vector<std::vector<glm::dvec3>> totalPos; 
+    // baked frames live on disk, only a few recent ones stay in memory
+    FrameCache frameCache;
+    std::string cachePath;
+    int cacheEncoding;
+    bool cacheDelta;
+    double cacheTolerance;
+    int checkpointInterval;
+    double densityTolerance;
+    int minIterations;
+    int maxIterations;
+    bool warmStart;
+    double warmDamping;
+    bool adaptiveStep;
+    double cfl;
+    double minStep;
+    double maxStep;
+    // seconds per frame at the scene's frame rate
+    double frameTime;
+    // solver state every checkpointInterval frames, next to the cache file
+    CheckpointStore checkpoints;
+    // trace file this node opened, empty while it only follows H2O_TRACE
+    std::string tracePath;
     std::vector<glm::dvec3> fluidPs;
+    // declared after frameCache so the worker is joined before the cache closes
+    FrameBaker baker;
 };
 #endif
@@ -1 +1,52 @@
 #include "fluid.h"
+
+template <typename T>
+static void PermuteArray(std::vector<T>& values, const std::vector<int>& order) {
+	std::vector<T> permuted(values.size());
+	for (size_t k = 0; k < order.size(); ++k) {
+		permuted[k] = values[order[k]];
+	}
+	values.swap(permuted);
+}
+
+template <typename Real>
+void FluidParticlesT<Real>::resize(size_t n) {
+	predictPos.resize(n, Vec3(0));
+	pos.resize(n, Vec3(0));
+	vel.resize(n, Vec3(0));
+	tmp.resize(n, Vec3(0));
+	density.resize(n, Real(0));
+	lambda.resize(n, Real(0));
+	deltaPos.resize(n, Vec3(0));
+	warmPos.resize(n, Vec3(0));
+	warmNeighbors.resize(n, 0);
+}
+
+template <typename Real>
+void FluidParticlesT<Real>::clear() {
+	predictPos.clear();
+	pos.clear();
+	vel.clear();
+	tmp.clear();
+	density.clear();
+	lambda.clear();
+	deltaPos.clear();
+	warmPos.clear();
+	warmNeighbors.clear();
+}
+
+template <typename Real>
+void FluidParticlesT<Real>::permute(const std::vector<int>& order) {
+	PermuteArray(predictPos, order);
+	PermuteArray(pos, order);
+	PermuteArray(vel, order);
+	PermuteArray(tmp, order);
+	PermuteArray(density, order);
+	PermuteArray(lambda, order);
+	PermuteArray(deltaPos, order);
+	PermuteArray(warmPos, order);
+	PermuteArray(warmNeighbors, order);
+}
+
+template class FluidParticlesT<double>;
+template class FluidParticlesT<float>;
@@ -23,26 +23,55 @@
 #ifndef DEF_FLUID
 	#define DEF_FLUID
 
+	#include <vector>
 	#include <glm/glm.hpp>
 
-	class Fluid {
+	// structure-of-arrays particle store: each attribute is contiguous so the
+	// neighbor loops only pull in the fields they actually read. Real is the
+	// storage precision, FluidSystem keeps its sums in double either way
+	template <typename Real>
+	class FluidParticlesT {
 	public:
-		Fluid(const glm::dvec3 &pos) : 
-			pos(pos), 
-			predictPos(glm::dvec3(0.0)), deltaPos(glm::dvec3(0.0)),
-			vel(glm::dvec3(0.0)), tmp(glm::dvec3(0.0)),
-			density(0.0), lambda(0.0), vorticity(glm::dvec3(0.0))
-		{}
-		glm::dvec3		predictPos;
-		glm::dvec3		pos;			// Basic particle (must match Particle class)
-		glm::dvec3		vel;
-
-		glm::dvec3	tmp; // store tmp calcs
-
-		double density;	
-		double lambda;
-		glm::dvec3 deltaPos;
-		glm::dvec3 vorticity;
+		typedef glm::tvec3<Real> Vec3;
+
+		void resize(size_t n);
+		void clear();
+		size_t size() const { return pos.size(); }
+		// new slot k takes the particle from old slot order[k]
+		void permute(const std::vector<int>& order);
+		// copy every attribute over from a store of another precision
+		template <typename Other>
+		void assign(const FluidParticlesT<Other>& other);
+
+		std::vector<Vec3> predictPos;
+		std::vector<Vec3> pos;
+		std::vector<Vec3> vel;
+
+		std::vector<Vec3> tmp; // store tmp calcs
+
+		std::vector<Real> density;
+		std::vector<Real> lambda;
+		std::vector<Vec3> deltaPos;
+		// constraint correction summed over the last step and the neighbor count it
+		// was made with, the warm start of the next step
+		std::vector<Vec3> warmPos;
+		std::vector<int> warmNeighbors;
 	};
 
+	typedef FluidParticlesT<double> FluidParticles;
+
+	template <typename Real>
+	template <typename Other>
+	void FluidParticlesT<Real>::assign(const FluidParticlesT<Other>& other) {
+		predictPos.assign(other.predictPos.begin(), other.predictPos.end());
+		pos.assign(other.pos.begin(), other.pos.end());
+		vel.assign(other.vel.begin(), other.vel.end());
+		tmp.assign(other.tmp.begin(), other.tmp.end());
+		density.assign(other.density.begin(), other.density.end());
+		lambda.assign(other.lambda.begin(), other.lambda.end());
+		deltaPos.assign(other.deltaPos.begin(), other.deltaPos.end());
+		warmPos.assign(other.warmPos.begin(), other.warmPos.end());
+		warmNeighbors = other.warmNeighbors;
+	}
+
 #endif
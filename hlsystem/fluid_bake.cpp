@@ -0,0 +1,97 @@
+#include "fluid_bake.h"
+#include "fluid_trace.h"
+
+FrameBaker::FrameBaker() :
+	checkpoints(nullptr),
+	baking(false),
+	cancelRequested(false),
+	writeFailed(false),
+	baked(0),
+	target(-1),
+	frontFrame(-1)
+{}
+
+FrameBaker::~FrameBaker() {
+	cancel();
+}
+
+void FrameBaker::start(FluidSystem* system, FrameCache* cache, int lastFrame, double scale) {
+	cancel();
+	cancelRequested = false;
+	writeFailed = false;
+	baked = cache->numFrames();
+	target = lastFrame;
+	if (baked > lastFrame) {
+		return;
+	}
+	baking = true;
+	worker = std::thread(&FrameBaker::Bake, this, system, cache, checkpoints, scale);
+}
+
+bool FrameBaker::extend(int lastFrame) {
+	std::lock_guard<std::mutex> guard(targetLock);
+	if (!baking) {
+		return false;
+	}
+	if (lastFrame > target) {
+		target = lastFrame;
+	}
+	return true;
+}
+
+void FrameBaker::cancel() {
+	cancelRequested = true;
+	if (worker.joinable()) {
+		worker.join();
+	}
+	baking = false;
+}
+
+std::shared_ptr<const std::vector<glm::dvec3>> FrameBaker::latest(int* frame) const {
+	std::lock_guard<std::mutex> guard(frontLock);
+	if (frame) {
+		*frame = frontFrame;
+	}
+	return front;
+}
+
+SolverStats FrameBaker::latestStats() const {
+	std::lock_guard<std::mutex> guard(frontLock);
+	return frontStats;
+}
+
+void FrameBaker::Bake(FluidSystem* system, FrameCache* cache, const CheckpointStore* store, double scale) {
+	Trace::NameThread("bake");
+	while (!cancelRequested) {
+		{
+			std::lock_guard<std::mutex> guard(targetLock);
+			if (baked > target) {
+				baking = false;
+				return;
+			}
+		}
+		int n = system->NumPoints();
+		back.resize(n);
+		for (int p = 0; p < n; ++p) {
+			back[p] = system->GetPos(p) * scale;
+		}
+		if (!cache->append(back) || (store && !store->save(*system, baked))) {
+			writeFailed = true;
+			break;
+		}
+		{
+			// hand the frame to readers, the old front is recycled once nobody holds it
+			std::shared_ptr<const std::vector<glm::dvec3>> published =
+				std::make_shared<const std::vector<glm::dvec3>>(std::move(back));
+			std::lock_guard<std::mutex> guard(frontLock);
+			front.swap(published);
+			frontFrame = baked;
+			frontStats = system->getStats();
+		}
+		++baked;
+
+		system->Run();
+	}
+	std::lock_guard<std::mutex> guard(targetLock);
+	baking = false;
+}
@@ -0,0 +1,69 @@
+#ifndef DEF_FLUID_BAKE
+	#define DEF_FLUID_BAKE
+
+	#include <atomic>
+	#include <memory>
+	#include <mutex>
+	#include <thread>
+	#include <vector>
+	#include <glm/glm.hpp>
+
+	#include "fluid_system.h"
+	#include "fluid_cache.h"
+	#include "fluid_checkpoint.h"
+
+	// runs FluidSystem::Run on a worker thread and streams every frame into a
+	// FrameCache. the last finished frame is also published through a front /
+	// back buffer pair so a viewer can show progress without going to disk.
+	// while a bake runs the system and the cache belong to the worker: cancel()
+	// before touching either from another thread
+	class FrameBaker {
+	public:
+		FrameBaker();
+		~FrameBaker();
+
+		// bakes from cache.numFrames() up to and including lastFrame, continuing
+		// from whatever state system is in. positions are multiplied by scale
+		void start(FluidSystem* system, FrameCache* cache, int lastFrame, double scale);
+		// checkpoint the solver into store as frames are baked, null for none.
+		// only read by start, the store must outlive the bake
+		void setCheckpoints(const CheckpointStore* store) { checkpoints = store; }
+		// raise the target of a running bake. true means the worker will bake up to
+		// lastFrame, false that it has stopped (or is stopping) and start is needed
+		bool extend(int lastFrame);
+		// stops after the frame in flight and waits for the worker
+		void cancel();
+
+		bool isBaking() const { return baking; }
+		// frames in the cache and the frame count the bake is heading for
+		int bakedFrames() const { return baked; }
+		int targetFrames() const { return target + 1; }
+		// set when a frame or checkpoint could not be written, the bake stops there
+		bool failed() const { return writeFailed; }
+		// newest frame the worker finished, null before the first one
+		std::shared_ptr<const std::vector<glm::dvec3>> latest(int* frame = nullptr) const;
+		// solver stats as of the newest frame, empty unless the system collects them
+		SolverStats latestStats() const;
+
+	private:
+		void Bake(FluidSystem* system, FrameCache* cache, const CheckpointStore* store, double scale);
+
+		std::thread worker;
+		const CheckpointStore* checkpoints;
+		std::atomic<bool> baking;
+		std::atomic<bool> cancelRequested;
+		std::atomic<bool> writeFailed;
+		std::atomic<int> baked;
+		std::atomic<int> target;
+		// the worker holds it to check target and to clear baking, so extend can't
+		// raise the target after the last check of a worker that is about to stop
+		std::mutex targetLock;
+
+		// front is what readers see, back is refilled by the worker every frame
+		mutable std::mutex frontLock;
+		std::shared_ptr<const std::vector<glm::dvec3>> front;
+		int frontFrame;
+		SolverStats frontStats;
+		std::vector<glm::dvec3> back;
+	};
+#endif
@@ -0,0 +1,66 @@
+// FrameBaker::extend racing the end of a bake: extend is called the moment the
+// last frame of the target is in the cache, while the worker is running the step
+// after it and about to find it has nothing left to do. whenever extend returns
+// true the new frames have to be baked without another start, like the SOP does
+#include <cstdio>
+#include <thread>
+
+#include "fluid_bake.h"
+
+int main() {
+	const int trials = 500;
+	const int first = 2;
+	const int extended = 4;
+	const char* path = "h2o_bake_test.cache";
+
+	// a few hundred particles so a frame takes well under a millisecond
+	FluidSystem fs;
+	fs.SPH_RADIUS = 0.1;
+	fs.SPH_VOLMIN = glm::dvec3(-2, -2, 0);
+	fs.SPH_VOLMAX = glm::dvec3(2, 2, 4);
+	fs.setThreadCount(1);
+	std::vector<glm::dvec3> points;
+	for (double x = -1.0; x < 1.0; x += 0.25) {
+		for (double y = -1.0; y < 1.0; y += 0.25) {
+			for (double z = 0.25; z < 1.5; z += 0.25) {
+				points.push_back(glm::dvec3(x, y, z));
+			}
+		}
+	}
+	fs.SPH_CreateExample(points);
+
+	CacheFormat format;
+	format.boxMin = fs.SPH_VOLMIN;
+	format.boxMax = fs.SPH_VOLMAX;
+	FrameBaker baker;
+	int accepted = 0;
+	int failures = 0;
+	for (int t = 0; t < trials; ++t) {
+		FrameCache cache;
+		if (!cache.open(path, fs.NumPoints(), format)) {
+			fprintf(stderr, "could not open %s\n", path);
+			return 1;
+		}
+		baker.start(&fs, &cache, first, 1.0 / fs.SPH_RADIUS);
+		while (baker.bakedFrames() <= first) {
+			std::this_thread::yield();
+		}
+		bool extendedBake = baker.extend(extended);
+		if (!extendedBake) {
+			baker.start(&fs, &cache, extended, 1.0 / fs.SPH_RADIUS);
+		}
+		while (baker.isBaking()) {
+			std::this_thread::yield();
+		}
+		baker.cancel();
+		accepted += extendedBake;
+		if (cache.numFrames() != extended + 1) {
+			fprintf(stderr, "trial %d: extend returned %s but the cache holds %d of %d frames\n",
+				t, extendedBake ? "true" : "false", cache.numFrames(), extended + 1);
+			++failures;
+		}
+	}
+	std::remove(path);
+	printf("%d trials, %d extended a running bake, %d lost frames\n", trials, accepted, failures);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,393 @@
+// solver benchmark: canonical scenes at fixed particle counts, per stage timing
+// and thread scaling sweeps. prints a table and optionally writes json for
+// tracking results across commits.
+//
+//   h2o_bench [--sizes 10000,100000,1000000] [--scenes dam,tank,double]
+//             [--steps N] [--warmup N] [--threads N] [--strong] [--weak]
+//             [--precision double|float] [--kernel poly6spiky|wendland]
+//             [--simd scalar|avx2|avx512] [--tolerance X] [--iterations N]
+//             [--warm-start DAMPING] [--solver jacobi|gauss-seidel] [--pairs] [--staged]
+//             [--viscosity X] [--vorticity X] [--pressure X] [--json out.json]
+//
+// scenes are built z up in the SOP's default box (-10 -10 0)..(10 10 20) at the
+// 0.5 point spacing the solver is tuned for. the box has room for roughly 10k
+// particles per scene, bigger counts scale the box up uniformly. H2O_TRACE=trace.json
+// records every stage as a chrome trace
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fluid_system.h"
+#include "fluid_trace.h"
+
+namespace {
+	const double SPACING = 0.5;
+	const glm::dvec3 BOX_MIN(-10.0, -10.0, 0.0);
+	const glm::dvec3 BOX_MAX(10.0, 10.0, 20.0);
+
+	// blocks of fluid as fractions of the box
+	struct Block {
+		glm::dvec3 lo;
+		glm::dvec3 hi;
+	};
+
+	struct Scene {
+		const char* name;
+		std::vector<Block> blocks;
+		// untimed steps on top of --warmup, the tank has to come to rest first
+		int settleSteps;
+	};
+
+	std::vector<Scene> Scenes() {
+		std::vector<Scene> scenes;
+		scenes.push_back({ "dam", { { glm::dvec3(0.0, 0.0, 0.0), glm::dvec3(0.4, 1.0, 0.5) } }, 0 });
+		scenes.push_back({ "tank", { { glm::dvec3(0.0, 0.0, 0.0), glm::dvec3(1.0, 1.0, 0.25) } }, 60 });
+		scenes.push_back({ "double", {
+			{ glm::dvec3(0.0, 0.0, 0.0), glm::dvec3(0.25, 1.0, 0.5) },
+			{ glm::dvec3(0.75, 0.0, 0.0), glm::dvec3(1.0, 1.0, 0.5) } }, 0 });
+		return scenes;
+	}
+
+	// lattice points of the scene in the given box, pass null to only count them
+	size_t Generate(const Scene& scene, glm::dvec3 boxMin, glm::dvec3 boxMax, std::vector<glm::dvec3>* points) {
+		size_t count = 0;
+		glm::dvec3 extent = boxMax - boxMin;
+		for (const Block& b : scene.blocks) {
+			// half a spacing off the walls so no point sits on the boundary
+			glm::dvec3 lo = boxMin + b.lo * extent + 0.5 * SPACING;
+			glm::dvec3 hi = boxMin + b.hi * extent;
+			glm::ivec3 n = glm::max(glm::ivec3(glm::floor((hi - lo) / SPACING)), glm::ivec3(0));
+			count += (size_t)n.x * n.y * n.z;
+			if (!points) {
+				continue;
+			}
+			for (int x = 0; x < n.x; ++x) {
+				for (int y = 0; y < n.y; ++y) {
+					for (int z = 0; z < n.z; ++z) {
+						points->push_back(lo + glm::dvec3(x, y, z) * SPACING);
+					}
+				}
+			}
+		}
+		return count;
+	}
+
+	// the box scale whose lattice gets closest to target points
+	double ScaleFor(const Scene& scene, size_t target) {
+		size_t base = Generate(scene, BOX_MIN, BOX_MAX, nullptr);
+		double scale = std::max(1.0, std::cbrt((double)target / (double)base));
+		// lattice counts step with the spacing, nudge until the next step overshoots
+		for (int i = 0; i < 64; ++i) {
+			double next = scale * 1.005;
+			size_t now = Generate(scene, BOX_MIN * scale, BOX_MAX * scale, nullptr);
+			if (now >= target) {
+				break;
+			}
+			size_t after = Generate(scene, BOX_MIN * next, BOX_MAX * next, nullptr);
+			if (after > target && after - target > target - now) {
+				break;
+			}
+			scale = next;
+		}
+		return scale;
+	}
+
+	struct Options {
+		std::vector<size_t> sizes = { 10000, 100000, 1000000 };
+		std::vector<std::string> scenes = { "dam", "tank", "double" };
+		int steps = 20;
+		int warmup = 5;
+		int threads = 0;
+		bool strong = false;
+		bool weak = false;
+		Precision precision = Precision::Double;
+		KernelType kernel = KernelType::Poly6Spiky;
+		SimdLevel simd = SimdLevel::AVX512;
+		// density tolerance, 0 runs the fixed two iterations
+		double tolerance = 0.0;
+		int iterations = 2;
+		// 0 compiles the term out of the step
+		double viscosity = 0.01;
+		double vorticity = 0.0003;
+		double pressure = 0.0001;
+		// 0 = cold start every step
+		double warmStart = 0.0;
+		SolveMode solver = SolveMode::Jacobi;
+		// owned pair traversal
+		bool pairs = false;
+		// every stage as its own pass, for per stage timings
+		bool staged = false;
+		std::string json;
+	};
+
+	struct Result {
+		std::string scene;
+		std::string sweep;
+		size_t target;
+		int points;
+		int threads;
+		int steps;
+		double seconds;
+		SolverStats stats;
+	};
+
+	std::vector<std::string> Split(const std::string& s) {
+		std::vector<std::string> parts;
+		size_t start = 0;
+		while (start <= s.size()) {
+			size_t end = s.find(',', start);
+			if (end == std::string::npos) {
+				end = s.size();
+			}
+			if (end > start) {
+				parts.push_back(s.substr(start, end - start));
+			}
+			start = end + 1;
+		}
+		return parts;
+	}
+
+	// 10000, 10k or 1m
+	bool ParseSize(const std::string& s, size_t& out) {
+		char* end;
+		double v = strtod(s.c_str(), &end);
+		if (end == s.c_str() || v <= 0.0) {
+			return false;
+		}
+		if (*end == 'k' || *end == 'K') {
+			v *= 1e3;
+			++end;
+		} else if (*end == 'm' || *end == 'M') {
+			v *= 1e6;
+			++end;
+		}
+		out = (size_t)v;
+		return !*end;
+	}
+
+	bool ParseArgs(int argc, char** argv, Options& opt) {
+		for (int i = 1; i < argc; ++i) {
+			std::string a = argv[i];
+			bool hasValue = i + 1 < argc;
+			std::string v = hasValue ? argv[i + 1] : "";
+			if (a == "--sizes" && hasValue) {
+				opt.sizes.clear();
+				for (const std::string& s : Split(v)) {
+					size_t n;
+					if (!ParseSize(s, n)) {
+						return false;
+					}
+					opt.sizes.push_back(n);
+				}
+			} else if (a == "--scenes" && hasValue) {
+				opt.scenes = Split(v);
+			} else if (a == "--steps" && hasValue) {
+				opt.steps = std::max(1, atoi(v.c_str()));
+			} else if (a == "--warmup" && hasValue) {
+				opt.warmup = std::max(0, atoi(v.c_str()));
+			} else if (a == "--threads" && hasValue) {
+				opt.threads = std::max(0, atoi(v.c_str()));
+			} else if (a == "--precision" && hasValue) {
+				opt.precision = v == "float" ? Precision::Float : Precision::Double;
+			} else if (a == "--kernel" && hasValue) {
+				opt.kernel = v == "wendland" ? KernelType::Wendland : KernelType::Poly6Spiky;
+			} else if (a == "--simd" && hasValue) {
+				opt.simd = v == "scalar" ? SimdLevel::Scalar : v == "avx2" ? SimdLevel::AVX2 : SimdLevel::AVX512;
+			} else if (a == "--tolerance" && hasValue) {
+				opt.tolerance = std::max(0.0, atof(v.c_str()));
+			} else if (a == "--iterations" && hasValue) {
+				opt.iterations = std::max(1, atoi(v.c_str()));
+			} else if (a == "--viscosity" && hasValue) {
+				opt.viscosity = atof(v.c_str());
+			} else if (a == "--vorticity" && hasValue) {
+				opt.vorticity = atof(v.c_str());
+			} else if (a == "--pressure" && hasValue) {
+				opt.pressure = atof(v.c_str());
+			} else if (a == "--warm-start" && hasValue) {
+				opt.warmStart = std::max(0.0, atof(v.c_str()));
+			} else if (a == "--solver" && hasValue) {
+				opt.solver = v == "gauss-seidel" ? SolveMode::GaussSeidel : SolveMode::Jacobi;
+			} else if (a == "--json" && hasValue) {
+				opt.json = v;
+			} else if (a == "--strong") {
+				opt.strong = true;
+				continue;
+			} else if (a == "--weak") {
+				opt.weak = true;
+				continue;
+			} else if (a == "--pairs") {
+				opt.pairs = true;
+				continue;
+			} else if (a == "--staged") {
+				opt.staged = true;
+				continue;
+			} else {
+				return false;
+			}
+			++i;
+		}
+		return true;
+	}
+
+	Result RunCase(const Options& opt, const Scene& scene, const char* sweep, size_t target, int threads) {
+		double scale = ScaleFor(scene, target);
+		std::vector<glm::dvec3> points;
+		Generate(scene, BOX_MIN * scale, BOX_MAX * scale, &points);
+
+		FluidSystem fs;
+		fs.SPH_RADIUS = 0.1;
+		fs.SPH_VOLMIN = BOX_MIN * scale;
+		fs.SPH_VOLMAX = BOX_MAX * scale;
+		fs.setThreadCount(threads);
+		fs.setPrecision(opt.precision);
+		fs.setKernel(opt.kernel);
+		fs.setSimdLevel(opt.simd);
+		fs.setParameters(opt.iterations, opt.viscosity, opt.vorticity, opt.pressure);
+		fs.setConvergence(opt.tolerance);
+		fs.setWarmStart(opt.warmStart > 0.0, opt.warmStart);
+		fs.setSolveMode(opt.solver);
+		fs.setPairTraversal(opt.pairs);
+		fs.setFusedIterations(!opt.staged);
+		fs.SPH_CreateExample(points);
+		for (int s = 0; s < opt.warmup + scene.settleSteps; ++s) {
+			fs.Run();
+		}
+
+		fs.setCollectStats(true);
+		fs.resetStats();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (int s = 0; s < opt.steps; ++s) {
+			fs.Run();
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		Result r;
+		r.scene = scene.name;
+		r.sweep = sweep;
+		r.target = target;
+		r.points = fs.NumPoints();
+		r.threads = fs.getThreadCount();
+		r.steps = opt.steps;
+		r.seconds = seconds;
+		r.stats = fs.getStats();
+		return r;
+	}
+
+	double AverageIterations(const SolverStats& t) {
+		return t.steps > 0 ? (double)t.constraintIterations / t.steps : 0.0;
+	}
+
+	void Print(const Result& r) {
+		const SolverStats& t = r.stats;
+		IterationTimes c = t.constraints();
+		double perStep = 1e3 / r.steps;
+		printf("%-7s %-6s %8d %3d %9.2f %12.4g | %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f | %5.2f\n",
+			r.scene.c_str(), r.sweep.c_str(), r.points, r.threads, r.steps / r.seconds,
+			(double)r.points * r.steps / r.seconds,
+			t.reorder * perStep, t.predict * perStep, t.neighbors * perStep, c.density * perStep,
+			c.lambda * perStep, c.corrections * perStep, c.apply * perStep, t.velocity * perStep,
+			t.vorticity * perStep, t.viscosity * perStep, AverageIterations(t));
+		fflush(stdout);
+	}
+
+	bool WriteJson(const std::string& path, const Options& opt, const std::vector<Result>& results) {
+		FILE* f = fopen(path.c_str(), "w");
+		if (!f) {
+			return false;
+		}
+		fprintf(f, "{\n  \"steps\": %d,\n  \"warmup\": %d,\n  \"precision\": \"%s\",\n  \"kernel\": \"%s\",\n"
+			"  \"solver\": \"%s\",\n  \"pairs\": %s,\n  \"staged\": %s,\n  \"tolerance\": %g,\n  \"viscosity\": %g,\n  \"vorticity\": %g,\n  \"pressure\": %g,\n  \"hardware_threads\": %u,\n  \"results\": [\n", opt.steps, opt.warmup,
+			opt.precision == Precision::Float ? "float" : "double",
+			opt.kernel == KernelType::Wendland ? "wendland" : "poly6spiky",
+			opt.solver == SolveMode::GaussSeidel ? "gauss-seidel" : "jacobi", opt.pairs ? "true" : "false",
+			opt.staged ? "true" : "false", opt.tolerance, opt.viscosity, opt.vorticity, opt.pressure,
+			std::thread::hardware_concurrency());
+		for (size_t i = 0; i < results.size(); ++i) {
+			const Result& r = results[i];
+			const SolverStats& t = r.stats;
+			IterationTimes c = t.constraints();
+			fprintf(f, "    {\"scene\": \"%s\", \"sweep\": \"%s\", \"target\": %zu, \"particles\": %d, \"threads\": %d, "
+				"\"steps\": %d, \"seconds\": %.6f, \"steps_per_second\": %.6f, \"particle_steps_per_second\": %.6f, "
+				"\"stage_seconds\": {\"reorder\": %.6f, \"predict\": %.6f, \"neighbors\": %.6f, \"warm_start\": %.6f, "
+				"\"density\": %.6f, \"lambda\": %.6f, \"corrections\": %.6f, \"apply\": %.6f, \"velocity\": %.6f, "
+				"\"vorticity\": %.6f, \"viscosity\": %.6f}, \"avg_neighbors\": %.3f, \"max_neighbors\": %d, \"occupied_cells\": %d, "
+				"\"avg_iterations\": %.3f, \"density_error\": %.6g, \"max_density_error\": %.6g}%s\n",
+				r.scene.c_str(), r.sweep.c_str(), r.target, r.points, r.threads, r.steps, r.seconds,
+				r.steps / r.seconds, (double)r.points * r.steps / r.seconds,
+				t.reorder, t.predict, t.neighbors, t.warmStart, c.density, c.lambda, c.corrections, c.apply,
+				t.velocity, t.vorticity, t.viscosity, t.avgNeighbors, t.maxNeighbors, t.occupiedCells,
+				AverageIterations(t), t.avgDensityError, t.maxDensityError, i + 1 < results.size() ? "," : "");
+		}
+		fprintf(f, "  ]\n}\n");
+		return fclose(f) == 0;
+	}
+}
+
+int main(int argc, char** argv) {
+	Trace::NameThread("main");
+	Options opt;
+	if (!ParseArgs(argc, argv, opt)) {
+		fprintf(stderr,
+			"usage: h2o_bench [--sizes 10k,100k,1m] [--scenes dam,tank,double] [--steps N] [--warmup N]\n"
+			"                 [--threads N] [--strong] [--weak] [--precision double|float]\n"
+			"                 [--kernel poly6spiky|wendland] [--simd scalar|avx2|avx512] [--tolerance X]\n"
+			"                 [--iterations N] [--warm-start DAMPING] [--solver jacobi|gauss-seidel]\n"
+			"                 [--pairs] [--staged] [--viscosity X] [--vorticity X] [--pressure X]\n"
+			"                 [--json out.json]\n");
+		return 1;
+	}
+	std::vector<Scene> all = Scenes();
+	std::vector<Scene> scenes;
+	for (const std::string& name : opt.scenes) {
+		auto it = std::find_if(all.begin(), all.end(), [&](const Scene& s) { return name == s.name; });
+		if (it == all.end()) {
+			fprintf(stderr, "unknown scene %s\n", name.c_str());
+			return 1;
+		}
+		scenes.push_back(*it);
+	}
+
+	// 1, 2, 4 .. up to every hardware thread
+	int maxThreads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<int> sweepThreads;
+	for (int t = 1; t < maxThreads; t *= 2) {
+		sweepThreads.push_back(t);
+	}
+	sweepThreads.push_back(maxThreads);
+
+	printf("%-7s %-6s %8s %3s %9s %12s | ms per step: %s\n", "scene", "sweep", "points", "thr", "steps/s",
+		"pt*steps/s", "reorder predict neighbr density  lambda correct   apply  veloc.  vortic viscos. | iters");
+	std::vector<Result> results;
+	for (const Scene& scene : scenes) {
+		for (size_t size : opt.sizes) {
+			results.push_back(RunCase(opt, scene, "fixed", size, opt.threads));
+			Print(results.back());
+		}
+		// strong: the largest size on more and more threads, weak: the smallest size times the thread count
+		if (opt.strong) {
+			size_t size = *std::max_element(opt.sizes.begin(), opt.sizes.end());
+			for (int t : sweepThreads) {
+				results.push_back(RunCase(opt, scene, "strong", size, t));
+				Print(results.back());
+			}
+		}
+		if (opt.weak) {
+			size_t size = *std::min_element(opt.sizes.begin(), opt.sizes.end());
+			for (int t : sweepThreads) {
+				results.push_back(RunCase(opt, scene, "weak", size * t, t));
+				Print(results.back());
+			}
+		}
+	}
+	if (!opt.json.empty() && !WriteJson(opt.json, opt, results)) {
+		fprintf(stderr, "could not write %s\n", opt.json.c_str());
+		return 1;
+	}
+	return 0;
+}
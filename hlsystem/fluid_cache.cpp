@@ -0,0 +1,680 @@
+#include <cmath>
+#include <cstring>
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+#include <glm/gtc/packing.hpp>
+
+#include "fluid_cache.h"
+#include "fluid_trace.h"
+
+// file layout: header, then one record per frame (record header + payload).
+// raw payloads are numPoints dvec3, encoded ones numPoints * 3 16 bit values
+// (codes, halves, or deltas to the keyframe), byte shuffled when the format says so
+namespace {
+	const char CACHE_MAGIC[8] = { 'H', '2', 'O', 'C', 'A', 'C', 'H', 'E' };
+	const unsigned int CACHE_VERSION = 2;
+
+	struct CacheHeader {
+		char magic[8];
+		unsigned int version;
+		unsigned int points;
+		unsigned int encoding;
+		unsigned int delta;
+		unsigned int shuffle;
+		int keyframeInterval;
+		double tolerance;
+		double boxMin[3];
+		double boxMax[3];
+	};
+
+	struct RecordHeader {
+		unsigned int encoding;
+		int key;
+		unsigned long long bytes;
+	};
+
+	size_t QueryMapGranularity() {
+	#ifdef _WIN32
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwAllocationGranularity;
+	#else
+		return (size_t)sysconf(_SC_PAGESIZE);
+	#endif
+	}
+
+	size_t MapGranularity() {
+		static const size_t granularity = QueryMapGranularity();
+		return granularity;
+	}
+
+	void Unmap(void* base, size_t length) {
+	#ifdef _WIN32
+		(void)length;
+		UnmapViewOfFile(base);
+	#else
+		munmap(base, length);
+	#endif
+	}
+
+	// value b of element i moves to b * count + i
+	void ShuffleBytes(const unsigned char* in, unsigned char* out, size_t count, size_t size) {
+		for (size_t i = 0; i < count; ++i) {
+			for (size_t b = 0; b < size; ++b) {
+				out[b * count + i] = in[i * size + b];
+			}
+		}
+	}
+
+	void UnshuffleBytes(const unsigned char* in, unsigned char* out, size_t count, size_t size) {
+		for (size_t i = 0; i < count; ++i) {
+			for (size_t b = 0; b < size; ++b) {
+				out[i * size + b] = in[b * count + i];
+			}
+		}
+	}
+
+	void StoreValues(const std::vector<unsigned short>& values, bool shuffle, std::vector<unsigned char>& payload) {
+		payload.resize(values.size() * sizeof(unsigned short));
+		if (shuffle) {
+			ShuffleBytes((const unsigned char*)values.data(), payload.data(), values.size(), sizeof(unsigned short));
+		} else {
+			std::memcpy(payload.data(), values.data(), payload.size());
+		}
+	}
+
+	void LoadValues(const unsigned char* data, size_t count, bool shuffle, std::vector<unsigned short>& values) {
+		values.resize(count);
+		if (shuffle) {
+			UnshuffleBytes(data, (unsigned char*)values.data(), count, sizeof(unsigned short));
+		} else {
+			std::memcpy(values.data(), data, count * sizeof(unsigned short));
+		}
+	}
+
+	// rounds x to a 16 bit step index, false outside the box
+	bool Quantize(double x, double lo, double step, unsigned short& code) {
+		double q = std::floor((x - lo) / step + 0.5);
+		if (!(q >= 0.0 && q <= 65535.0)) {
+			return false;
+		}
+		code = (unsigned short)q;
+		return true;
+	}
+}
+
+FrameView::FrameView() :
+	points(nullptr),
+	count(0),
+	mapBase(nullptr),
+	mapLength(0)
+{}
+
+FrameView::FrameView(std::shared_ptr<const std::vector<glm::dvec3>> frame) :
+	points(frame ? frame->data() : nullptr),
+	count(frame ? (int)frame->size() : 0),
+	mapBase(nullptr),
+	mapLength(0),
+	resident(std::move(frame))
+{}
+
+FrameView::~FrameView() {
+	release();
+}
+
+FrameView::FrameView(FrameView&& other) :
+	points(other.points),
+	count(other.count),
+	mapBase(other.mapBase),
+	mapLength(other.mapLength),
+	resident(std::move(other.resident))
+{
+	other.points = nullptr;
+	other.count = 0;
+	other.mapBase = nullptr;
+	other.mapLength = 0;
+}
+
+FrameView& FrameView::operator=(FrameView&& other) {
+	if (this != &other) {
+		release();
+		points = other.points;
+		count = other.count;
+		mapBase = other.mapBase;
+		mapLength = other.mapLength;
+		resident = std::move(other.resident);
+		other.points = nullptr;
+		other.count = 0;
+		other.mapBase = nullptr;
+		other.mapLength = 0;
+	}
+	return *this;
+}
+
+void FrameView::release() {
+	if (mapBase) {
+		Unmap(mapBase, mapLength);
+	}
+	points = nullptr;
+	count = 0;
+	mapBase = nullptr;
+	mapLength = 0;
+	resident.reset();
+}
+
+FrameCache::FrameCache() :
+	pointCount(0),
+	step(1.0),
+	endOffset(0),
+	fallbacks(0),
+	window(FRAME_CACHE_WINDOW),
+	keyIndex(-1),
+#ifdef _WIN32
+	file(INVALID_HANDLE_VALUE)
+#else
+	file(-1)
+#endif
+{}
+
+FrameCache::~FrameCache() {
+	close();
+}
+
+bool FrameCache::isOpen() const {
+#ifdef _WIN32
+	return file != INVALID_HANDLE_VALUE;
+#else
+	return file >= 0;
+#endif
+}
+
+bool FrameCache::Write(const void* data, size_t bytes) {
+	const char* p = (const char*)data;
+	while (bytes > 0) {
+	#ifdef _WIN32
+		DWORD chunk = (DWORD)(bytes < (1u << 30) ? bytes : (1u << 30));
+		DWORD written = 0;
+		if (!WriteFile((HANDLE)file, p, chunk, &written, NULL) || written == 0) {
+			return false;
+		}
+	#else
+		ssize_t written = ::write(file, p, bytes);
+		if (written <= 0) {
+			return false;
+		}
+	#endif
+		p += written;
+		bytes -= written;
+		endOffset += written;
+	}
+	return true;
+}
+
+bool FrameCache::open(const std::string& cachePath, int points, const CacheFormat& cacheFormat) {
+	close();
+#ifdef _WIN32
+	file = CreateFileA(cachePath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+#else
+	file = ::open(cachePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (!isOpen()) {
+		return false;
+	}
+	path = cachePath;
+	pointCount = points;
+	format = cacheFormat;
+	for (int a = 0; a < 3; ++a) {
+		double extent = format.boxMax[a] - format.boxMin[a];
+		step[a] = extent > 0.0 ? extent / 65535.0 : 1.0;
+	}
+
+	CacheHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.points = (unsigned int)points;
+	header.encoding = (unsigned int)format.encoding;
+	header.delta = format.delta ? 1 : 0;
+	header.shuffle = format.shuffle ? 1 : 0;
+	header.keyframeInterval = format.keyframeInterval;
+	header.tolerance = format.tolerance;
+	for (int a = 0; a < 3; ++a) {
+		header.boxMin[a] = format.boxMin[a];
+		header.boxMax[a] = format.boxMax[a];
+	}
+	if (!Write(&header, sizeof(header))) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool FrameCache::reopen(const std::string& cachePath) {
+	close();
+#ifdef _WIN32
+	file = CreateFileA(cachePath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER size;
+	size.QuadPart = 0;
+	if (isOpen()) {
+		GetFileSizeEx((HANDLE)file, &size);
+	}
+	unsigned long long fileBytes = (unsigned long long)size.QuadPart;
+#else
+	file = ::open(cachePath.c_str(), O_RDWR);
+	unsigned long long fileBytes = isOpen() ? (unsigned long long)lseek(file, 0, SEEK_END) : 0;
+#endif
+	if (!isOpen()) {
+		return false;
+	}
+	if (fileBytes < sizeof(CacheHeader)) {
+		close();
+		return false;
+	}
+
+	// walk the records in one mapping, the last one may be incomplete
+	size_t length;
+	const unsigned char* data;
+	void* base = Map(0, (size_t)fileBytes, length, data);
+	if (!base) {
+		close();
+		return false;
+	}
+	CacheHeader header;
+	std::memcpy(&header, data, sizeof(header));
+	if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION) {
+		Unmap(base, length);
+		close();
+		return false;
+	}
+	path = cachePath;
+	pointCount = (int)header.points;
+	format.encoding = (CacheEncoding)header.encoding;
+	format.delta = header.delta != 0;
+	format.shuffle = header.shuffle != 0;
+	format.keyframeInterval = header.keyframeInterval;
+	format.tolerance = header.tolerance;
+	for (int a = 0; a < 3; ++a) {
+		format.boxMin[a] = header.boxMin[a];
+		format.boxMax[a] = header.boxMax[a];
+		double extent = format.boxMax[a] - format.boxMin[a];
+		step[a] = extent > 0.0 ? extent / 65535.0 : 1.0;
+	}
+
+	std::vector<Record> found;
+	int raw = 0;
+	unsigned long long offset = sizeof(CacheHeader);
+	while (offset + sizeof(RecordHeader) <= fileBytes) {
+		RecordHeader recordHeader;
+		std::memcpy(&recordHeader, data + offset, sizeof(recordHeader));
+		unsigned long long end = offset + sizeof(RecordHeader) + recordHeader.bytes + (8 - recordHeader.bytes % 8) % 8;
+		if (end > fileBytes || recordHeader.key >= (int)found.size()) {
+			break;
+		}
+		Record record;
+		record.offset = offset + sizeof(RecordHeader);
+		record.bytes = recordHeader.bytes;
+		record.encoding = (CacheEncoding)recordHeader.encoding;
+		record.key = recordHeader.key;
+		raw += record.encoding == CacheEncoding::Raw && format.encoding != CacheEncoding::Raw;
+		found.push_back(record);
+		offset = end;
+	}
+	Unmap(base, length);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		records.swap(found);
+	}
+	fallbacks = raw;
+	if (!SetEnd(offset)) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool FrameCache::truncate(int frames) {
+	if (!isOpen() || frames < 0) {
+		return false;
+	}
+	unsigned long long offset;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (frames >= (int)records.size()) {
+			return true;
+		}
+		offset = frames > 0 ? records[frames - 1].offset + records[frames - 1].bytes : sizeof(CacheHeader);
+		offset += (8 - offset % 8) % 8;
+		records.resize(frames);
+		while (!recent.empty() && recent.back().first >= frames) {
+			recent.pop_back();
+		}
+	}
+	// the next frame starts a new keyframe
+	keyIndex = -1;
+	keyCodes.clear();
+	keyPos.clear();
+	return SetEnd(offset);
+}
+
+bool FrameCache::SetEnd(unsigned long long offset) {
+#ifdef _WIN32
+	LARGE_INTEGER position;
+	position.QuadPart = (LONGLONG)offset;
+	if (!SetFilePointerEx((HANDLE)file, position, NULL, FILE_BEGIN) || !SetEndOfFile((HANDLE)file)) {
+		return false;
+	}
+#else
+	if (ftruncate(file, (off_t)offset) != 0 || lseek(file, (off_t)offset, SEEK_SET) < 0) {
+		return false;
+	}
+#endif
+	endOffset = offset;
+	return true;
+}
+
+void FrameCache::close() {
+	if (isOpen()) {
+	#ifdef _WIN32
+		CloseHandle((HANDLE)file);
+		file = INVALID_HANDLE_VALUE;
+	#else
+		::close(file);
+		file = -1;
+	#endif
+	}
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		records.clear();
+		recent.clear();
+	}
+	pointCount = 0;
+	endOffset = 0;
+	fallbacks = 0;
+	keyIndex = -1;
+	keyCodes.clear();
+	keyPos.clear();
+}
+
+int FrameCache::numFrames() const {
+	std::lock_guard<std::mutex> guard(lock);
+	return (int)records.size();
+}
+
+void FrameCache::setWindow(int count) {
+	std::lock_guard<std::mutex> guard(lock);
+	window = count < 0 ? 0 : count;
+	while ((int)recent.size() > window) {
+		recent.pop_front();
+	}
+}
+
+bool FrameCache::WriteRecord(CacheEncoding encoding, int key, const std::vector<unsigned char>& payload) {
+	RecordHeader header;
+	header.encoding = (unsigned int)encoding;
+	header.key = key;
+	header.bytes = payload.size();
+	if (!Write(&header, sizeof(header))) {
+		return false;
+	}
+	Record record;
+	record.offset = endOffset;
+	record.bytes = payload.size();
+	record.encoding = encoding;
+	record.key = key;
+	// keep every record 8 byte aligned so raw frames map as dvec3 arrays
+	static const unsigned char padding[8] = { 0 };
+	if (!Write(payload.data(), payload.size()) || !Write(padding, (8 - payload.size() % 8) % 8)) {
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	records.push_back(record);
+	return true;
+}
+
+// frame as 16 bit values, deltas to the keyframe when delta is set. codes and
+// decoded receive the quantization codes and what a reader will get back.
+// false when any component misses the tolerance or a delta does not fit
+bool FrameCache::EncodeValues(const std::vector<glm::dvec3>& frame, bool delta, std::vector<unsigned short>& out,
+	std::vector<unsigned short>& codes, std::vector<glm::dvec3>& decoded) const {
+	bool quantized = format.encoding == CacheEncoding::Quantized16;
+	glm::dvec3 center = 0.5 * (format.boxMin + format.boxMax);
+	size_t values = frame.size() * 3;
+	out.resize(values);
+	codes.assign(quantized ? values : 0, 0);
+	decoded.resize(frame.size());
+	for (size_t v = 0; v < values; ++v) {
+		size_t i = v / 3;
+		int a = (int)(v % 3);
+		double x = frame[i][a];
+		if (quantized) {
+			if (!Quantize(x, format.boxMin[a], step[a], codes[v])) {
+				return false;
+			}
+			decoded[i][a] = format.boxMin[a] + codes[v] * step[a];
+			if (delta) {
+				// deltas of codes are exact, only the quantization itself costs precision
+				int d = (int)codes[v] - (int)keyCodes[v];
+				if (d < -32768 || d > 32767) {
+					return false;
+				}
+				out[v] = (unsigned short)(short)d;
+			} else {
+				out[v] = codes[v];
+			}
+		} else if (delta) {
+			// against the decoded keyframe so errors never accumulate along the deltas
+			out[v] = glm::packHalf1x16((float)(x - keyPos[i][a]));
+			decoded[i][a] = keyPos[i][a] + glm::unpackHalf1x16(out[v]);
+		} else {
+			// halves are relative to the box center, precision drops with magnitude
+			out[v] = glm::packHalf1x16((float)(x - center[a]));
+			decoded[i][a] = center[a] + glm::unpackHalf1x16(out[v]);
+		}
+		if (!(std::abs(decoded[i][a] - x) <= format.tolerance)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// a delta to the current keyframe when the format allows it, else a new keyframe
+bool FrameCache::Encode(const std::vector<glm::dvec3>& frame, std::vector<unsigned char>& payload, int& key) {
+	int index = numFrames();
+	std::vector<unsigned short> out;
+	std::vector<unsigned short> codes;
+	std::vector<glm::dvec3> decoded;
+	if (format.delta && keyIndex >= 0 && index - keyIndex < format.keyframeInterval &&
+		EncodeValues(frame, true, out, codes, decoded)) {
+		key = keyIndex;
+		StoreValues(out, format.shuffle, payload);
+		return true;
+	}
+
+	key = -1;
+	keyIndex = -1;
+	if (!EncodeValues(frame, false, out, codes, decoded)) {
+		if (format.delta && format.encoding == CacheEncoding::Half) {
+			// this frame goes to disk raw, half deltas can still build on it exactly
+			keyIndex = index;
+			keyPos = frame;
+		}
+		return false;
+	}
+	if (format.delta) {
+		keyIndex = index;
+		keyCodes.swap(codes);
+		keyPos.swap(decoded);
+	}
+	StoreValues(out, format.shuffle, payload);
+	return true;
+}
+
+bool FrameCache::append(std::vector<glm::dvec3> frame) {
+	if (!isOpen() || (int)frame.size() != pointCount) {
+		return false;
+	}
+	// only this thread adds records, reading the count needs no lock
+	TraceSpan span("cache append", "cache", (int)records.size());
+	bool written;
+	if (format.encoding == CacheEncoding::Raw) {
+		std::vector<unsigned char> payload((const unsigned char*)frame.data(),
+			(const unsigned char*)frame.data() + frame.size() * sizeof(glm::dvec3));
+		written = WriteRecord(CacheEncoding::Raw, -1, payload);
+	} else {
+		std::vector<unsigned char> payload;
+		int key;
+		if (Encode(frame, payload, key)) {
+			written = WriteRecord(format.encoding, key, payload);
+		} else {
+			++fallbacks;
+			payload.assign((const unsigned char*)frame.data(),
+				(const unsigned char*)frame.data() + frame.size() * sizeof(glm::dvec3));
+			written = WriteRecord(CacheEncoding::Raw, -1, payload);
+		}
+	}
+	if (!written) {
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	if (window > 0) {
+		recent.push_back(std::make_pair((int)records.size() - 1,
+			std::make_shared<const std::vector<glm::dvec3>>(std::move(frame))));
+		if ((int)recent.size() > window) {
+			recent.pop_front();
+		}
+	}
+	return true;
+}
+
+void* FrameCache::Map(unsigned long long offset, size_t bytes, size_t& length, const unsigned char*& data) const {
+	// mappings have to start on the allocation granularity
+	unsigned long long aligned = offset - offset % MapGranularity();
+	length = (size_t)(offset - aligned) + bytes;
+#ifdef _WIN32
+	HANDLE mapping = CreateFileMappingA((HANDLE)file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		return nullptr;
+	}
+	void* base = MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)(aligned >> 32), (DWORD)aligned, length);
+	// the view keeps the mapping object alive
+	CloseHandle(mapping);
+	if (!base) {
+		return nullptr;
+	}
+#else
+	void* base = mmap(nullptr, length, PROT_READ, MAP_SHARED, file, (off_t)aligned);
+	if (base == MAP_FAILED) {
+		return nullptr;
+	}
+#endif
+	data = (const unsigned char*)base + (offset - aligned);
+	return base;
+}
+
+bool FrameCache::Decode(const Record& record, const Record* key, std::vector<glm::dvec3>& out) const {
+	size_t values = (size_t)pointCount * 3;
+	size_t length;
+	const unsigned char* data;
+	void* base = Map(record.offset, (size_t)record.bytes, length, data);
+	if (!base) {
+		return false;
+	}
+	if (record.encoding == CacheEncoding::Raw) {
+		const glm::dvec3* points = (const glm::dvec3*)data;
+		out.assign(points, points + pointCount);
+		Unmap(base, length);
+		return true;
+	}
+	std::vector<unsigned short> stored;
+	LoadValues(data, values, format.shuffle, stored);
+	Unmap(base, length);
+
+	out.resize(pointCount);
+	bool quantized = record.encoding == CacheEncoding::Quantized16;
+	if (!key) {
+		glm::dvec3 center = 0.5 * (format.boxMin + format.boxMax);
+		for (size_t v = 0; v < values; ++v) {
+			int a = (int)(v % 3);
+			out[v / 3][a] = quantized ? format.boxMin[a] + stored[v] * step[a] : center[a] + glm::unpackHalf1x16(stored[v]);
+		}
+		return true;
+	}
+
+	if (quantized) {
+		base = Map(key->offset, (size_t)key->bytes, length, data);
+		if (!base) {
+			return false;
+		}
+		std::vector<unsigned short> keyValues;
+		LoadValues(data, values, format.shuffle, keyValues);
+		Unmap(base, length);
+		for (size_t v = 0; v < values; ++v) {
+			int a = (int)(v % 3);
+			int code = (int)keyValues[v] + (short)stored[v];
+			out[v / 3][a] = format.boxMin[a] + code * step[a];
+		}
+	} else {
+		std::vector<glm::dvec3> keyFrame;
+		if (!Decode(*key, nullptr, keyFrame)) {
+			return false;
+		}
+		for (size_t v = 0; v < values; ++v) {
+			int a = (int)(v % 3);
+			out[v / 3][a] = keyFrame[v / 3][a] + glm::unpackHalf1x16(stored[v]);
+		}
+	}
+	return true;
+}
+
+FrameView FrameCache::frame(int index) const {
+	FrameView view;
+	Record record;
+	Record key;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!isOpen() || index < 0 || index >= (int)records.size() || pointCount == 0) {
+			return view;
+		}
+		for (auto& r : recent) {
+			if (r.first == index) {
+				return FrameView(r.second);
+			}
+		}
+		record = records[index];
+		if (record.key >= 0) {
+			key = records[record.key];
+		}
+	}
+
+	if (record.encoding != CacheEncoding::Raw) {
+		std::shared_ptr<std::vector<glm::dvec3>> decoded = std::make_shared<std::vector<glm::dvec3>>();
+		if (!Decode(record, record.key >= 0 ? &key : nullptr, *decoded)) {
+			return view;
+		}
+		return FrameView(decoded);
+	}
+
+	size_t length;
+	const unsigned char* data;
+	void* base = Map(record.offset, (size_t)record.bytes, length, data);
+	if (!base) {
+		return view;
+	}
+	view.mapBase = base;
+	view.mapLength = length;
+	view.points = (const glm::dvec3*)data;
+	view.count = pointCount;
+	return view;
+}
@@ -0,0 +1,144 @@
+#ifndef DEF_FLUID_CACHE
+	#define DEF_FLUID_CACHE
+
+	#include <atomic>
+	#include <deque>
+	#include <memory>
+	#include <mutex>
+	#include <string>
+	#include <vector>
+	#include <glm/glm.hpp>
+
+	// recent frames kept in memory on top of the file
+	#define FRAME_CACHE_WINDOW 8
+	// frames between keyframes when delta encoding
+	#define FRAME_CACHE_KEYFRAME_INTERVAL 10
+
+	// how positions are stored on disk
+	enum class CacheEncoding {
+		Raw,			// 3 doubles, read back zero-copy
+		Quantized16,	// 16 bit steps across the format box
+		Half			// 3 half floats
+	};
+
+	struct CacheFormat {
+		CacheEncoding encoding = CacheEncoding::Raw;
+		// quantization box, points outside it make the frame fall back to raw
+		glm::dvec3 boxMin = glm::dvec3(0.0);
+		glm::dvec3 boxMax = glm::dvec3(1.0);
+		// store frames as differences to the last keyframe
+		bool delta = false;
+		int keyframeInterval = FRAME_CACHE_KEYFRAME_INTERVAL;
+		// group the n-th byte of every value together, compresses better downstream
+		bool shuffle = true;
+		// largest per component error an encoded frame may have, anything worse is stored raw
+		double tolerance = 1e-3;
+	};
+
+	// read-only view of one cached frame: a resident copy, a decoded copy or a
+	// mapping of a raw frame in the cache file. stays valid after more frames are
+	// appended or the window moves
+	class FrameView {
+	public:
+		FrameView();
+		~FrameView();
+		FrameView(FrameView&& other);
+		FrameView& operator=(FrameView&& other);
+		FrameView(const FrameView&) = delete;
+		FrameView& operator=(const FrameView&) = delete;
+
+		// wraps a frame that already lives in memory
+		explicit FrameView(std::shared_ptr<const std::vector<glm::dvec3>> frame);
+
+		bool valid() const { return points != nullptr; }
+		const glm::dvec3* data() const { return points; }
+		int size() const { return count; }
+		const glm::dvec3& operator[](int i) const { return points[i]; }
+
+	private:
+		friend class FrameCache;
+		void release();
+
+		const glm::dvec3* points;
+		int count;
+		// set when the view owns a file mapping
+		void* mapBase;
+		size_t mapLength;
+		std::shared_ptr<const std::vector<glm::dvec3>> resident;
+	};
+
+	// append-only frame store: every frame goes straight to a file as it is baked,
+	// reads map just that frame so memory stays at the window plus what is on screen.
+	// one thread may open / append / close while any number of others call frame()
+	class FrameCache {
+	public:
+		FrameCache();
+		~FrameCache();
+
+		// creates (or truncates) the cache file, every frame holds points positions
+		bool open(const std::string& path, int points, const CacheFormat& format = CacheFormat());
+		// opens an existing cache to append to, format and points come from the file.
+		// a frame cut short by a crash is dropped
+		bool reopen(const std::string& path);
+		// drops every frame from index frames on, views of those frames must be gone
+		bool truncate(int frames);
+		void close();
+		bool isOpen() const;
+
+		bool append(std::vector<glm::dvec3> frame);
+		FrameView frame(int index) const;
+
+		int numFrames() const;
+		int numPoints() const { return pointCount; }
+		const CacheFormat& getFormat() const { return format; }
+		// bytes written so far, header included
+		unsigned long long fileSize() const { return endOffset; }
+		// frames that missed the tolerance and went to disk raw
+		int rawFallbacks() const { return fallbacks; }
+		void setWindow(int frames);
+
+	private:
+		struct Record {
+			unsigned long long offset;	// payload start
+			unsigned long long bytes;
+			CacheEncoding encoding;
+			int key;					// keyframe this frame is a delta of, -1 for none
+		};
+
+		bool Write(const void* data, size_t bytes);
+		// cuts the file at offset and moves the write position there
+		bool SetEnd(unsigned long long offset);
+		bool WriteRecord(CacheEncoding encoding, int key, const std::vector<unsigned char>& payload);
+		bool EncodeValues(const std::vector<glm::dvec3>& frame, bool delta, std::vector<unsigned short>& out,
+			std::vector<unsigned short>& codes, std::vector<glm::dvec3>& decoded) const;
+		bool Encode(const std::vector<glm::dvec3>& frame, std::vector<unsigned char>& payload, int& key);
+		// key is the record a delta frame refers to, null for keyframes
+		bool Decode(const Record& record, const Record* key, std::vector<glm::dvec3>& out) const;
+		// maps [offset, offset + bytes) of the file read-only
+		void* Map(unsigned long long offset, size_t bytes, size_t& length, const unsigned char*& data) const;
+
+		std::string path;
+		int pointCount;
+		CacheFormat format;
+		glm::dvec3 step;
+		std::atomic<unsigned long long> endOffset;
+		std::atomic<int> fallbacks;
+
+		// guards records and recent, the only state readers touch
+		mutable std::mutex lock;
+		std::vector<Record> records;
+		int window;
+		std::deque<std::pair<int, std::shared_ptr<const std::vector<glm::dvec3>>>> recent;
+
+		// encoder state for delta frames: the last keyframe as codes and as decoded positions
+		int keyIndex;
+		std::vector<unsigned short> keyCodes;
+		std::vector<glm::dvec3> keyPos;
+
+	#ifdef _WIN32
+		void* file;
+	#else
+		int file;
+	#endif
+	};
+#endif
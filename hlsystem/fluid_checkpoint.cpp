@@ -0,0 +1,243 @@
+#include <cstdio>
+#include <cstring>
+
+#include "fluid_checkpoint.h"
+#include "fluid_trace.h"
+
+// file layout: header, then pos and vel at storage precision in storage order,
+// then the input id of every storage slot, then the warm start buffers if it is on
+namespace {
+	const char CHECKPOINT_MAGIC[8] = { 'H', '2', 'O', 'C', 'K', 'P', 'T', '1' };
+	// 2 added the time stepping, 3 the density tolerance, 4 the warm start, 5 the solve mode
+	const unsigned int CHECKPOINT_VERSION = 5;
+
+	struct CheckpointHeader {
+		char magic[8];
+		unsigned int version;
+		unsigned int points;
+		unsigned int precision;
+		unsigned int kernel;
+		unsigned int gridType;
+		unsigned int boundary;
+		unsigned int solveMode;
+		int iterations;
+		int reorderInterval;
+		int stepsSinceReorder;
+		int stepCount;
+		double radius;
+		double viscosity;
+		double vorticity;
+		double kCorr;
+		double verletSkin;
+		double neighborGap;
+		double sortedNeighborGap;
+		double volMin[3];
+		double volMax[3];
+		double force[3];
+		double frameTime;
+		double cfl;
+		double minTimeStep;
+		double maxTimeStep;
+		double densityTolerance;
+		int minIterations;
+		int maxIterations;
+		int warmStart;
+		double warmDamping;
+	};
+
+	template <typename T>
+	bool WriteArray(FILE* f, const std::vector<T>& values) {
+		return fwrite(values.data(), sizeof(T), values.size(), f) == values.size();
+	}
+
+	template <typename T>
+	bool ReadArray(FILE* f, std::vector<T>& values) {
+		return fread(values.data(), sizeof(T), values.size(), f) == values.size();
+	}
+}
+
+bool FluidSystem::SaveCheckpoint(const std::string& path) const {
+	CheckpointHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	header.version = CHECKPOINT_VERSION;
+	header.points = (unsigned int)NumPoints();
+	header.precision = (unsigned int)precision;
+	header.kernel = (unsigned int)kernelType;
+	header.gridType = (unsigned int)gridType;
+	header.boundary = useBoundary ? 1 : 0;
+	header.solveMode = (unsigned int)solveMode;
+	header.iterations = myIteration;
+	header.reorderInterval = reorderInterval;
+	header.stepsSinceReorder = stepsSinceReorder;
+	header.stepCount = stepCount;
+	header.radius = SPH_RADIUS;
+	header.viscosity = viscConst;
+	header.vorticity = vortConst;
+	header.kCorr = kCorr;
+	header.verletSkin = verletSkin;
+	header.neighborGap = neighborGap;
+	header.sortedNeighborGap = sortedNeighborGap;
+	header.frameTime = frameTime;
+	header.cfl = cflNumber;
+	header.minTimeStep = minTimeStep;
+	header.maxTimeStep = maxTimeStep;
+	header.densityTolerance = densityTolerance;
+	header.minIterations = minIterations;
+	header.maxIterations = maxIterations;
+	header.warmStart = warmStart ? 1 : 0;
+	header.warmDamping = warmDamping;
+	for (int a = 0; a < 3; ++a) {
+		header.volMin[a] = SPH_VOLMIN[a];
+		header.volMax[a] = SPH_VOLMAX[a];
+		header.force[a] = FORCE[a];
+	}
+
+	// write next to the target and rename, a crash mid write keeps the old checkpoint
+	std::string partial = path + ".part";
+	FILE* f = fopen(partial.c_str(), "wb");
+	if (!f) {
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	if (precision == Precision::Float) {
+		ok = ok && WriteArray(f, fluidPsF.pos) && WriteArray(f, fluidPsF.vel);
+	} else {
+		ok = ok && WriteArray(f, fluidPs.pos) && WriteArray(f, fluidPs.vel);
+	}
+	ok = ok && WriteArray(f, particleId);
+	if (warmStart) {
+		if (precision == Precision::Float) {
+			ok = ok && WriteArray(f, fluidPsF.warmPos) && WriteArray(f, fluidPsF.warmNeighbors);
+		} else {
+			ok = ok && WriteArray(f, fluidPs.warmPos) && WriteArray(f, fluidPs.warmNeighbors);
+		}
+	}
+	ok = fclose(f) == 0 && ok;
+	if (ok) {
+		std::remove(path.c_str());
+		ok = std::rename(partial.c_str(), path.c_str()) == 0;
+	}
+	if (!ok) {
+		std::remove(partial.c_str());
+	}
+	return ok;
+}
+
+bool FluidSystem::LoadCheckpoint(const std::string& path) {
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f) {
+		return false;
+	}
+	CheckpointHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+		std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+		header.version != CHECKPOINT_VERSION) {
+		fclose(f);
+		return false;
+	}
+
+	cleanUp();
+	precision = (Precision)header.precision;
+	kernelType = (KernelType)header.kernel;
+	gridType = (GridType)header.gridType;
+	useBoundary = header.boundary != 0;
+	solveMode = (SolveMode)header.solveMode;
+	reorderInterval = header.reorderInterval;
+	verletSkin = header.verletSkin;
+	setParameters(header.iterations, header.viscosity, header.vorticity, header.kCorr);
+	setFrameTime(header.frameTime);
+	setAdaptiveStep(header.cfl, header.minTimeStep, header.maxTimeStep);
+	setConvergence(header.densityTolerance, header.minIterations, header.maxIterations);
+	warmStart = header.warmStart != 0;
+	warmDamping = header.warmDamping;
+	SPH_RADIUS = header.radius;
+	for (int a = 0; a < 3; ++a) {
+		SPH_VOLMIN[a] = header.volMin[a];
+		SPH_VOLMAX[a] = header.volMax[a];
+		FORCE[a] = header.force[a];
+	}
+	SetupKernels();
+	scaledMin = glm::dvec3(SPH_VOLMIN) * SPH_RADIUS;
+	scaledMax = glm::dvec3(SPH_VOLMAX) * SPH_RADIUS;
+
+	Allocate(header.points);
+	bool ok;
+	if (precision == Precision::Float) {
+		ok = ReadArray(f, fluidPsF.pos) && ReadArray(f, fluidPsF.vel);
+	} else {
+		ok = ReadArray(f, fluidPs.pos) && ReadArray(f, fluidPs.vel);
+	}
+	ok = ok && ReadArray(f, particleId);
+	if (warmStart) {
+		if (precision == Precision::Float) {
+			ok = ok && ReadArray(f, fluidPsF.warmPos) && ReadArray(f, fluidPsF.warmNeighbors);
+		} else {
+			ok = ok && ReadArray(f, fluidPs.warmPos) && ReadArray(f, fluidPs.warmNeighbors);
+		}
+	}
+	fclose(f);
+	for (int k = 0; ok && k < (int)header.points; ++k) {
+		if (particleId[k] < 0 || particleId[k] >= (int)header.points) {
+			ok = false;
+		} else {
+			slotOf[particleId[k]] = k;
+		}
+	}
+	if (!ok) {
+		cleanUp();
+		return false;
+	}
+	stepsSinceReorder = header.stepsSinceReorder;
+	stepCount = header.stepCount;
+	neighborGap = header.neighborGap;
+	sortedNeighborGap = header.sortedNeighborGap;
+	SetupGrid();
+	return true;
+}
+
+CheckpointStore::CheckpointStore() :
+	interval(0)
+{}
+
+void CheckpointStore::setup(const std::string& checkpointBase, int checkpointInterval) {
+	base = checkpointBase;
+	interval = checkpointInterval < 0 ? 0 : checkpointInterval;
+}
+
+std::string CheckpointStore::path(int frame) const {
+	return base + "." + std::to_string(frame) + ".h2ockpt";
+}
+
+bool CheckpointStore::save(const FluidSystem& system, int frame) const {
+	// frame 0 is the input itself
+	if (!enabled() || frame <= 0 || frame % interval != 0) {
+		return true;
+	}
+	TraceSpan span("checkpoint", "cache", frame);
+	return system.SaveCheckpoint(path(frame));
+}
+
+int CheckpointStore::nearest(int frame) const {
+	if (!enabled()) {
+		return -1;
+	}
+	for (int f = frame - frame % interval; f > 0; f -= interval) {
+		FILE* probe = fopen(path(f).c_str(), "rb");
+		if (probe) {
+			fclose(probe);
+			return f;
+		}
+	}
+	return -1;
+}
+
+int CheckpointStore::restore(FluidSystem& system, int frame) const {
+	// an unreadable checkpoint falls back to the one before it
+	for (int f = nearest(frame); f > 0; f = nearest(f - 1)) {
+		if (system.LoadCheckpoint(path(f))) {
+			return f;
+		}
+	}
+	return -1;
+}
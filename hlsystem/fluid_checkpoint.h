@@ -0,0 +1,32 @@
+#ifndef DEF_FLUID_CHECKPOINT
+	#define DEF_FLUID_CHECKPOINT
+
+	#include <string>
+
+	#include "fluid_system.h"
+
+	// solver checkpoints next to a bake, <base>.<frame>.h2ockpt every few frames.
+	// a checkpoint for frame f holds the state whose positions are frame f, so
+	// restoring it and running reproduces the frames after it
+	class CheckpointStore {
+	public:
+		CheckpointStore();
+
+		// interval 0 turns checkpoints off
+		void setup(const std::string& base, int interval);
+		bool enabled() const { return interval > 0 && !base.empty(); }
+		int getInterval() const { return interval; }
+		std::string path(int frame) const;
+
+		// writes one when frame lands on the interval, false only if writing failed
+		bool save(const FluidSystem& system, int frame) const;
+		// newest checkpoint at or before frame, -1 if there is none
+		int nearest(int frame) const;
+		// loads nearest(frame) into system and returns its frame, -1 if nothing was loaded
+		int restore(FluidSystem& system, int frame) const;
+
+	private:
+		std::string base;
+		int interval;
+	};
+#endif
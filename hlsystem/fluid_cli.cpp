@@ -0,0 +1,459 @@
+// headless driver: bakes a point list with the same parameters as the SOP and
+// writes one file per frame, so farm nodes can bake without Houdini.
+//
+//   h2o_sim [options] input.(ply|bin) output.####.(ply|bin)
+//
+// inputs and outputs are y up like Houdini unless --z-up is given, the solver
+// itself runs z up the way the SOP feeds it. H2O_TRACE=trace.json records a
+// chrome trace of the bake
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "fluid_system.h"
+#include "fluid_checkpoint.h"
+#include "fluid_trace.h"
+
+namespace {
+	struct Options {
+		std::string input;
+		std::string output;
+		// defaults match the SOP parameters
+		int frames = 60;
+		int iterations = 2;
+		double pressure = 0.0001;
+		double viscosity = 0.01;
+		double vorticity = 0.0;
+		glm::dvec3 minCorner = glm::dvec3(-10.0, 0.0, -10.0);
+		glm::dvec3 maxCorner = glm::dvec3(10.0, 20.0, 10.0);
+		glm::dvec3 force = glm::dvec3(0.0, -9.8, 0.0);
+		int threads = 0;
+		GridType grid = GridType::Auto;
+		bool boundary = true;
+		Precision precision = Precision::Double;
+		KernelType kernel = KernelType::Poly6Spiky;
+		SolveMode solver = SolveMode::Jacobi;
+		bool pairs = false;
+		bool staged = false;
+		// 0 keeps the SOP's one fixed m_DT step per frame
+		double fps = 0.0;
+		double cfl = 0.0;
+		double minStep = MIN_TIME_STEP;
+		double maxStep = MAX_TIME_STEP;
+		// 0 runs exactly --iterations per step
+		double tolerance = 0.0;
+		int minIterations = MIN_CONSTRAINT_ITERATIONS;
+		int maxIterations = MAX_CONSTRAINT_ITERATIONS;
+		// 0 = cold start every step
+		double warmStart = 0.0;
+		bool zUp = false;
+		std::string checkpointBase;
+		int checkpointInterval = 0;
+		bool resume = false;
+		bool quiet = false;
+	};
+
+	void Usage() {
+		fprintf(stderr,
+			"usage: h2o_sim [options] input.(ply|bin) output.####.(ply|bin)\n"
+			"  input is a point list, .bin is packed xyz doubles. #### in the output\n"
+			"  becomes the zero padded frame number\n"
+			"  --frames N               last frame to bake (60)\n"
+			"  --iterations N           constraint iterations (2)\n"
+			"  --pressure X             artificial pressure (0.0001)\n"
+			"  --viscosity X            (0.01)\n"
+			"  --vorticity X            vorticity confinement (0)\n"
+			"  --min X Y Z              min corner (-10 0 -10)\n"
+			"  --max X Y Z              max corner (10 20 10)\n"
+			"  --force X Y Z            (0 -9.8 0)\n"
+			"  --threads N              0 = one per core (0)\n"
+			"  --grid auto|dense|sparse (auto)\n"
+			"  --no-boundary            don't clamp to the box\n"
+			"  --precision double|float (double)\n"
+			"  --kernel poly6spiky|wendland (poly6spiky)\n"
+			"  --solver jacobi|gauss-seidel (jacobi)\n"
+			"  --pairs                  visit each neighbor pair once (jacobi only)\n"
+			"  --staged                 run every solver stage as its own pass\n"
+			"  --tolerance X            stop iterating once the mean compression is below X\n"
+			"  --iteration-range MIN MAX  iteration bounds with a tolerance (1 8)\n"
+			"  --warm-start DAMPING     replay this share of last step's corrections (0 = off)\n"
+			"  --fps N                  frames per second, each frame covers 1/N seconds\n"
+			"                           (default one fixed step of 0.0083)\n"
+			"  --cfl X                  substep so nothing moves more than X radii (0 = off)\n"
+			"  --step-range MIN MAX     substep clamp in seconds (0.0001 0.0167)\n"
+			"  --z-up                   points and vectors are already z up\n"
+			"  --checkpoints BASE N     write BASE.<frame>.h2ockpt every N frames\n"
+			"  --resume                 continue from the newest checkpoint\n"
+			"  --quiet\n");
+	}
+
+	bool ParseInt(const char* s, int& out) {
+		char* end;
+		long v = strtol(s, &end, 10);
+		if (end == s || *end) {
+			return false;
+		}
+		out = (int)v;
+		return true;
+	}
+
+	bool ParseDouble(const char* s, double& out) {
+		char* end;
+		out = strtod(s, &end);
+		return end != s && !*end;
+	}
+
+	bool ParseArgs(int argc, char** argv, Options& opt) {
+		std::vector<std::string> positional;
+		for (int i = 1; i < argc; ++i) {
+			std::string a = argv[i];
+			// how many values follow the flag
+			int values = 0;
+			if (a == "--frames" || a == "--iterations" || a == "--pressure" || a == "--viscosity" ||
+				a == "--vorticity" || a == "--threads" || a == "--grid" || a == "--precision" || a == "--kernel" || a == "--solver" ||
+				a == "--fps" || a == "--cfl" || a == "--tolerance" ||
+				a == "--warm-start") {
+				values = 1;
+			} else if (a == "--checkpoints" || a == "--step-range" || a == "--iteration-range") {
+				values = 2;
+			} else if (a == "--min" || a == "--max" || a == "--force") {
+				values = 3;
+			}
+			if (i + values >= argc) {
+				fprintf(stderr, "%s needs %d value(s)\n", a.c_str(), values);
+				return false;
+			}
+			char** v = argv + i + 1;
+			bool ok = true;
+			if (a == "--frames") {
+				ok = ParseInt(v[0], opt.frames) && opt.frames >= 0;
+			} else if (a == "--iterations") {
+				ok = ParseInt(v[0], opt.iterations) && opt.iterations >= 0;
+			} else if (a == "--pressure") {
+				ok = ParseDouble(v[0], opt.pressure);
+			} else if (a == "--viscosity") {
+				ok = ParseDouble(v[0], opt.viscosity);
+			} else if (a == "--vorticity") {
+				ok = ParseDouble(v[0], opt.vorticity);
+			} else if (a == "--min" || a == "--max" || a == "--force") {
+				glm::dvec3& vec = a == "--min" ? opt.minCorner : a == "--max" ? opt.maxCorner : opt.force;
+				ok = ParseDouble(v[0], vec.x) && ParseDouble(v[1], vec.y) && ParseDouble(v[2], vec.z);
+			} else if (a == "--threads") {
+				ok = ParseInt(v[0], opt.threads) && opt.threads >= 0;
+			} else if (a == "--grid") {
+				std::string g = v[0];
+				ok = g == "auto" || g == "dense" || g == "sparse";
+				opt.grid = g == "dense" ? GridType::Dense : g == "sparse" ? GridType::Hashed : GridType::Auto;
+			} else if (a == "--no-boundary") {
+				opt.boundary = false;
+			} else if (a == "--precision") {
+				std::string p = v[0];
+				ok = p == "double" || p == "float";
+				opt.precision = p == "float" ? Precision::Float : Precision::Double;
+			} else if (a == "--kernel") {
+				std::string k = v[0];
+				ok = k == "poly6spiky" || k == "wendland";
+				opt.kernel = k == "wendland" ? KernelType::Wendland : KernelType::Poly6Spiky;
+			} else if (a == "--tolerance") {
+				ok = ParseDouble(v[0], opt.tolerance) && opt.tolerance >= 0.0;
+			} else if (a == "--iteration-range") {
+				ok = ParseInt(v[0], opt.minIterations) && ParseInt(v[1], opt.maxIterations) &&
+					opt.minIterations >= 1 && opt.maxIterations >= opt.minIterations;
+			} else if (a == "--warm-start") {
+				ok = ParseDouble(v[0], opt.warmStart) && opt.warmStart >= 0.0 && opt.warmStart <= 1.0;
+			} else if (a == "--fps") {
+				ok = ParseDouble(v[0], opt.fps) && opt.fps > 0.0;
+			} else if (a == "--cfl") {
+				ok = ParseDouble(v[0], opt.cfl) && opt.cfl >= 0.0;
+			} else if (a == "--step-range") {
+				ok = ParseDouble(v[0], opt.minStep) && ParseDouble(v[1], opt.maxStep) &&
+					opt.minStep > 0.0 && opt.maxStep >= opt.minStep;
+			} else if (a == "--solver") {
+				std::string m = v[0];
+				ok = m == "jacobi" || m == "gauss-seidel";
+				opt.solver = m == "gauss-seidel" ? SolveMode::GaussSeidel : SolveMode::Jacobi;
+			} else if (a == "--z-up") {
+				opt.zUp = true;
+			} else if (a == "--checkpoints") {
+				opt.checkpointBase = v[0];
+				ok = ParseInt(v[1], opt.checkpointInterval) && opt.checkpointInterval >= 0;
+			} else if (a == "--resume") {
+				opt.resume = true;
+			} else if (a == "--pairs") {
+				opt.pairs = true;
+			} else if (a == "--staged") {
+				opt.staged = true;
+			} else if (a == "--quiet") {
+				opt.quiet = true;
+			} else if (a == "--help" || a == "-h") {
+				return false;
+			} else if (a.size() > 1 && a[0] == '-') {
+				fprintf(stderr, "unknown option %s\n", a.c_str());
+				return false;
+			} else {
+				positional.push_back(a);
+			}
+			if (!ok) {
+				fprintf(stderr, "bad value for %s\n", a.c_str());
+				return false;
+			}
+			i += values;
+		}
+		if (positional.size() != 2) {
+			return false;
+		}
+		opt.input = positional[0];
+		opt.output = positional[1];
+		return true;
+	}
+
+	bool EndsWith(const std::string& s, const char* suffix) {
+		size_t n = strlen(suffix);
+		return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+	}
+
+	// the SOP swaps y and z on the way in and out, the swap is its own inverse
+	glm::dvec3 Flip(const glm::dvec3& v, bool zUp) {
+		return zUp ? v : glm::dvec3(v.x, v.z, v.y);
+	}
+
+	bool ReadBinary(const std::string& path, std::vector<glm::dvec3>& points) {
+		FILE* f = fopen(path.c_str(), "rb");
+		if (!f) {
+			return false;
+		}
+		fseek(f, 0, SEEK_END);
+		long bytes = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		if (bytes < 0 || bytes % sizeof(glm::dvec3) != 0) {
+			fclose(f);
+			return false;
+		}
+		points.resize(bytes / sizeof(glm::dvec3));
+		bool ok = fread(points.data(), sizeof(glm::dvec3), points.size(), f) == points.size();
+		fclose(f);
+		return ok;
+	}
+
+	// ascii or little endian binary ply, x y z of the vertex element (which has to
+	// come first). other vertex properties are skipped
+	bool ReadPly(const std::string& path, std::vector<glm::dvec3>& points) {
+		FILE* f = fopen(path.c_str(), "rb");
+		if (!f) {
+			return false;
+		}
+		struct Property {
+			std::string name;
+			int size;
+			bool real;
+		};
+		std::vector<Property> props;
+		long count = -1;
+		bool ascii = false;
+		bool inVertex = false;
+		bool ok = true;
+		char line[512];
+		if (!fgets(line, sizeof(line), f) || strncmp(line, "ply", 3) != 0) {
+			ok = false;
+		}
+		while (ok && fgets(line, sizeof(line), f)) {
+			char word[64] = { 0 };
+			char type[64] = { 0 };
+			char name[64] = { 0 };
+			if (sscanf(line, "%63s", word) != 1) {
+				continue;
+			}
+			std::string w = word;
+			if (w == "format") {
+				sscanf(line, "%*s %63s", type);
+				ascii = strcmp(type, "ascii") == 0;
+				ok = ascii || strcmp(type, "binary_little_endian") == 0;
+			} else if (w == "element") {
+				long n = 0;
+				sscanf(line, "%*s %63s %ld", name, &n);
+				inVertex = strcmp(name, "vertex") == 0;
+				if (inVertex) {
+					count = n;
+				} else if (count < 0) {
+					ok = false;
+				}
+			} else if (w == "property" && inVertex) {
+				if (sscanf(line, "%*s %63s %63s", type, name) != 2 || strcmp(type, "list") == 0) {
+					ok = false;
+					break;
+				}
+				std::string t = type;
+				Property p;
+				p.name = name;
+				p.real = t == "float" || t == "float32" || t == "double" || t == "float64";
+				p.size = t == "double" || t == "float64" ? 8 :
+					t == "float" || t == "float32" || t == "int" || t == "int32" || t == "uint" || t == "uint32" ? 4 :
+					t == "short" || t == "int16" || t == "ushort" || t == "uint16" ? 2 : 1;
+				props.push_back(p);
+			} else if (w == "end_header") {
+				break;
+			}
+		}
+		int axis[3] = { -1, -1, -1 };
+		for (int k = 0; k < (int)props.size(); ++k) {
+			for (int a = 0; a < 3; ++a) {
+				if (props[k].name == std::string(1, (char)('x' + a)) && props[k].real) {
+					axis[a] = k;
+				}
+			}
+		}
+		ok = ok && count >= 0 && axis[0] >= 0 && axis[1] >= 0 && axis[2] >= 0;
+
+		points.resize(ok ? count : 0);
+		std::vector<double> values(props.size());
+		for (long i = 0; ok && i < count; ++i) {
+			for (int k = 0; ok && k < (int)props.size(); ++k) {
+				if (ascii) {
+					ok = fscanf(f, "%lf", &values[k]) == 1;
+				} else {
+					unsigned char b[8];
+					ok = fread(b, props[k].size, 1, f) == 1;
+					if (props[k].real && props[k].size == 8) {
+						memcpy(&values[k], b, 8);
+					} else if (props[k].real) {
+						float v;
+						memcpy(&v, b, 4);
+						values[k] = v;
+					}
+				}
+			}
+			points[i] = glm::dvec3(values[axis[0]], values[axis[1]], values[axis[2]]);
+		}
+		fclose(f);
+		return ok;
+	}
+
+	bool WriteFrame(const std::string& path, const std::vector<glm::dvec3>& points) {
+		FILE* f = fopen(path.c_str(), "wb");
+		if (!f) {
+			return false;
+		}
+		bool ok;
+		if (EndsWith(path, ".ply")) {
+			fprintf(f, "ply\nformat binary_little_endian 1.0\nelement vertex %d\n"
+				"property float x\nproperty float y\nproperty float z\nend_header\n", (int)points.size());
+			std::vector<glm::vec3> out(points.begin(), points.end());
+			ok = fwrite(out.data(), sizeof(glm::vec3), out.size(), f) == out.size();
+		} else {
+			ok = fwrite(points.data(), sizeof(glm::dvec3), points.size(), f) == points.size();
+		}
+		return fclose(f) == 0 && ok;
+	}
+
+	// replaces the run of # in pattern with the padded frame, or appends .frame
+	std::string FramePath(const std::string& pattern, int frame) {
+		size_t first = pattern.find('#');
+		std::string number = std::to_string(frame);
+		if (first == std::string::npos) {
+			size_t dot = pattern.rfind('.');
+			return dot == std::string::npos ? pattern + "." + number : pattern.substr(0, dot) + "." + number + pattern.substr(dot);
+		}
+		size_t last = pattern.find_first_not_of('#', first);
+		size_t width = (last == std::string::npos ? pattern.size() : last) - first;
+		if (number.size() < width) {
+			number.insert(0, width - number.size(), '0');
+		}
+		return pattern.substr(0, first) + number + pattern.substr(first + width);
+	}
+}
+
+int main(int argc, char** argv) {
+	Options opt;
+	if (!ParseArgs(argc, argv, opt)) {
+		Usage();
+		return 1;
+	}
+
+	Trace::NameThread("main");
+	FluidSystem fs;
+	// same radius as the SOP, the solver expects 0.5 spaced input points
+	fs.SPH_RADIUS = 0.1;
+	fs.setThreadCount(opt.threads);
+	// how the stages run isn't part of a checkpoint
+	fs.setPairTraversal(opt.pairs);
+	fs.setFusedIterations(!opt.staged);
+
+	CheckpointStore checkpoints;
+	checkpoints.setup(opt.checkpointBase, opt.checkpointInterval);
+	int start = opt.resume ? checkpoints.restore(fs, opt.frames) : -1;
+	if (opt.resume && start < 0) {
+		fprintf(stderr, "no checkpoint to resume from, starting at frame 0\n");
+	}
+
+	if (start < 0) {
+		std::vector<glm::dvec3> input;
+		bool read = EndsWith(opt.input, ".ply") ? ReadPly(opt.input, input) : ReadBinary(opt.input, input);
+		if (!read) {
+			fprintf(stderr, "could not read points from %s\n", opt.input.c_str());
+			return 1;
+		}
+		glm::dvec3 lo = Flip(opt.minCorner, opt.zUp);
+		glm::dvec3 hi = Flip(opt.maxCorner, opt.zUp);
+		for (glm::dvec3& p : input) {
+			p = Flip(p, opt.zUp);
+			if (opt.boundary && !(glm::all(glm::greaterThan(p, lo)) && glm::all(glm::lessThan(p, hi)))) {
+				fprintf(stderr, "fluid volume out of bounds, shrink the fluid or grow the box\n");
+				return 1;
+			}
+		}
+		fs.setParameters(opt.iterations, opt.viscosity, opt.vorticity, opt.pressure);
+		fs.SPH_VOLMIN = lo;
+		fs.SPH_VOLMAX = hi;
+		fs.FORCE = Flip(opt.force, opt.zUp);
+		fs.setGridType(opt.grid);
+		fs.setBoundary(opt.boundary);
+		fs.setPrecision(opt.precision);
+		fs.setKernel(opt.kernel);
+		fs.setSolveMode(opt.solver);
+		fs.setFrameTime(opt.fps > 0.0 ? 1.0 / opt.fps : m_DT);
+		fs.setAdaptiveStep(opt.cfl, opt.minStep, opt.maxStep);
+		fs.setConvergence(opt.tolerance, opt.minIterations, opt.maxIterations);
+		fs.setWarmStart(opt.warmStart > 0.0, opt.warmStart);
+		fs.SPH_CreateExample(input);
+		start = 0;
+	}
+	if (!opt.quiet) {
+		fprintf(stderr, "%d points, frames %d..%d, %d threads, %s\n", fs.NumPoints(), start, opt.frames,
+			fs.getThreadCount(), SimdLevelName(fs.getSimdLevel()));
+	}
+
+	std::vector<glm::dvec3> frame(fs.NumPoints());
+	for (int f = start; f <= opt.frames; ++f) {
+		for (int p = 0; p < fs.NumPoints(); ++p) {
+			frame[p] = Flip(fs.GetPos(p) / fs.SPH_RADIUS, opt.zUp);
+		}
+		std::string path = FramePath(opt.output, f);
+		{
+			TraceSpan span("write frame", "cache", f);
+			if (!WriteFrame(path, frame)) {
+				fprintf(stderr, "could not write %s\n", path.c_str());
+				return 1;
+			}
+		}
+		if (!checkpoints.save(fs, f)) {
+			fprintf(stderr, "could not write checkpoint %s\n", checkpoints.path(f).c_str());
+			return 1;
+		}
+		if (!opt.quiet) {
+			fprintf(stderr, "frame %d", f);
+			if (f > start && fs.getCfl() > 0.0) {
+				fprintf(stderr, ", %d substeps", fs.getSubsteps());
+			}
+			if (f > start && fs.getTolerance() > 0.0) {
+				fprintf(stderr, ", %d iterations, density error %.4g", fs.getIterationsUsed(), fs.getDensityError());
+			}
+			fprintf(stderr, "\n");
+		}
+		if (f < opt.frames) {
+			fs.Run();
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,216 @@
+#include <algorithm>
+
+#include "fluid_grid.h"
+
+void CellList::resize(const glm::ivec3& gridDims, int particles) {
+	dims = gridDims;
+	int cells = dims.x * dims.y * dims.z;
+	keys.assign(particles, -1);
+	cellStart.assign(cells, 0);
+	cellCount.assign(cells, 0);
+	sortedIndices.assign(particles, -1);
+	slot.clear();
+	cellFill = std::vector<std::atomic<int>>();
+}
+
+void CellList::clear() {
+	keys.clear();
+	cellStart.clear();
+	cellCount.clear();
+	sortedIndices.clear();
+	slot.clear();
+	cellFill = std::vector<std::atomic<int>>();
+}
+
+void CellList::Build(const std::vector<glm::ivec3>& cells) {
+	int numCells = (int)cellCount.size();
+	int n = (int)cells.size();
+	for (int i = 0; i < n; ++i) {
+		keys[i] = FindCell(cells[i]);
+	}
+
+	std::fill(cellCount.begin(), cellCount.end(), 0);
+	for (int key : keys) {
+		if (key >= 0) {
+			++cellCount[key];
+		}
+	}
+
+	int sum = 0;
+	for (int c = 0; c < numCells; ++c) {
+		cellStart[c] = sum;
+		sum += cellCount[c];
+	}
+
+	// scatter in particle order so each cell stays sorted by particle index
+	std::fill(cellCount.begin(), cellCount.end(), 0);
+	for (int i = 0; i < (int)keys.size(); ++i) {
+		int key = keys[i];
+		if (key >= 0) {
+			sortedIndices[cellStart[key] + cellCount[key]++] = i;
+		}
+	}
+}
+
+void CellList::BuildParallel(const std::vector<glm::ivec3>& cellPos, TaskScheduler& scheduler) {
+	int cells = (int)cellCount.size();
+	int n = (int)cellPos.size();
+	int numThreads = scheduler.ThreadCount();
+	int grain = std::max(1, (n + numThreads - 1) / numThreads);
+	int cellGrain = std::max(1, (cells + numThreads - 1) / numThreads);
+	if ((int)cellFill.size() != cells) {
+		cellFill = std::vector<std::atomic<int>>(cells);
+	}
+	slot.resize(n);
+
+	scheduler.ParallelFor(cells, cellGrain, [&](int begin, int end) {
+		for (int c = begin; c < end; ++c) {
+			cellFill[c].store(0, std::memory_order_relaxed);
+		}
+	});
+
+	// count, remembering each particle's rank inside its cell
+	scheduler.ParallelFor(n, grain, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			int key = FindCell(cellPos[i]);
+			keys[i] = key;
+			if (key >= 0) {
+				slot[i] = cellFill[key].fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+	});
+
+	// blocked exclusive prefix sum: per block totals, scan the totals, then offset each block
+	int numBlocks = (cells + cellGrain - 1) / cellGrain;
+	std::vector<int> blockSums(numBlocks + 1, 0);
+	scheduler.ParallelFor(cells, cellGrain, [&](int begin, int end) {
+		int sum = 0;
+		for (int c = begin; c < end; ++c) {
+			cellCount[c] = cellFill[c].load(std::memory_order_relaxed);
+			cellStart[c] = sum;
+			sum += cellCount[c];
+		}
+		blockSums[begin / cellGrain + 1] = sum;
+	});
+	for (int b = 0; b < numBlocks; ++b) {
+		blockSums[b + 1] += blockSums[b];
+	}
+	scheduler.ParallelFor(cells, cellGrain, [&](int begin, int end) {
+		int offset = blockSums[begin / cellGrain];
+		for (int c = begin; c < end; ++c) {
+			cellStart[c] += offset;
+		}
+	});
+
+	scheduler.ParallelFor(n, grain, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			int key = keys[i];
+			if (key >= 0) {
+				sortedIndices[cellStart[key] + slot[i]] = i;
+			}
+		}
+	});
+
+	// atomic ranks depend on thread timing, restore particle order inside each cell
+	// so neighbor order (and therefore the float sums) matches the serial build
+	scheduler.ParallelFor(cells, cellGrain, [&](int begin, int end) {
+		for (int c = begin; c < end; ++c) {
+			if (cellCount[c] > 1) {
+				int* first = sortedIndices.data() + cellStart[c];
+				std::sort(first, first + cellCount[c]);
+			}
+		}
+	});
+}
+
+void HashedCellList::resize(int particles) {
+	entries.resize(particles);
+	sortedIndices.resize(particles);
+	cellKey.clear();
+	cellStart.clear();
+	cellCount.clear();
+	cellNeighbors.clear();
+	table.assign(1, -1);
+	tableMask = 0;
+}
+
+void HashedCellList::clear() {
+	entries.clear();
+	sortedIndices.clear();
+	cellKey.clear();
+	cellStart.clear();
+	cellCount.clear();
+	cellNeighbors.clear();
+	table.assign(1, -1);
+	tableMask = 0;
+}
+
+void HashedCellList::Build(const std::vector<glm::ivec3>& cells, TaskScheduler& scheduler) {
+	int n = (int)cells.size();
+	int numThreads = scheduler.ThreadCount();
+	int grain = std::max(1, (n + numThreads - 1) / numThreads);
+
+	// sort (key, index) pairs: sort each block in parallel, then merge neighbouring blocks
+	scheduler.ParallelFor(n, grain, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			entries[i].key = PackKey(cells[i]);
+			entries[i].index = i;
+		}
+		std::sort(entries.begin() + begin, entries.begin() + end);
+	});
+	for (int width = grain; width < n; width *= 2) {
+		int pairs = (n + 2 * width - 1) / (2 * width);
+		scheduler.ParallelFor(pairs, 1, [&](int begin, int end) {
+			for (int b = begin; b < end; ++b) {
+				int first = b * 2 * width;
+				int middle = std::min(n, first + width);
+				int last = std::min(n, first + 2 * width);
+				std::inplace_merge(entries.begin() + first, entries.begin() + middle, entries.begin() + last);
+			}
+		});
+	}
+
+	// runs of equal keys are the occupied cells
+	cellKey.clear();
+	cellStart.clear();
+	cellCount.clear();
+	for (int k = 0; k < n; ++k) {
+		if (k == 0 || entries[k].key != entries[k - 1].key) {
+			cellKey.push_back(entries[k].key);
+			cellStart.push_back(k);
+			cellCount.push_back(0);
+		}
+		++cellCount.back();
+		sortedIndices[k] = entries[k].index;
+	}
+
+	size_t capacity = 2;
+	while (capacity < 2 * cellKey.size()) {
+		capacity *= 2;
+	}
+	table.assign(capacity, -1);
+	tableMask = capacity - 1;
+	for (int c = 0; c < (int)cellKey.size(); ++c) {
+		size_t h = Hash(cellKey[c]) & tableMask;
+		while (table[h] >= 0) {
+			h = (h + 1) & tableMask;
+		}
+		table[h] = c;
+	}
+
+	int occupied = (int)cellKey.size();
+	cellNeighbors.resize((size_t)occupied * 27);
+	scheduler.ParallelFor(occupied, 256, [&](int begin, int end) {
+		for (int c = begin; c < end; ++c) {
+			glm::ivec3 center = UnpackKey(cellKey[c]);
+			int* block = &cellNeighbors[(size_t)c * 27];
+			for (int x = -1; x <= 1; x++) {
+				for (int y = -1; y <= 1; y++) {
+					for (int z = -1; z <= 1; z++) {
+						*block++ = FindCell(center + glm::ivec3(x, y, z));
+					}
+				}
+			}
+		}
+	});
+}
@@ -0,0 +1,185 @@
+#ifndef DEF_FLUID_GRID
+	#define DEF_FLUID_GRID
+
+	#include <vector>
+	#include <atomic>
+	#include <cstdint>
+	#include <glm/glm.hpp>
+
+	#include "fluid_threads.h"
+
+	// z-order curve key of a cell, 21 bits per axis so negative (unbounded) cells sort too
+	inline uint64_t MortonKey(const glm::ivec3& cell) {
+		auto spread = [](uint64_t v) {
+			v &= 0x1fffff;
+			v = (v | v << 32) & 0x1f00000000ffffULL;
+			v = (v | v << 16) & 0x1f0000ff0000ffULL;
+			v = (v | v << 8) & 0x100f00f00f00f00fULL;
+			v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+			v = (v | v << 2) & 0x1249249249249249ULL;
+			return v;
+		};
+		const int bias = 1 << 20;
+		return spread((uint64_t)(cell.x + bias)) |
+			spread((uint64_t)(cell.y + bias)) << 1 |
+			spread((uint64_t)(cell.z + bias)) << 2;
+	}
+
+	enum class GridType {
+		Auto,	// dense unless the box has far more cells than particles
+		Dense,
+		Hashed
+	};
+
+	// compact cell list built with a counting sort: particles are sorted by cell
+	// key so each cell is a contiguous [start, start + count) range of sortedIndices.
+	// memory is O(cells + particles) instead of one heap vector per cell.
+	class CellList {
+	public:
+		void resize(const glm::ivec3& dims, int particles);
+		void clear();
+
+		// cells[i] is the grid cell of particle i, particles outside the grid are skipped
+		void Build(const std::vector<glm::ivec3>& cells);
+		// same result as Build but counts, scans and scatters across the pool
+		void BuildParallel(const std::vector<glm::ivec3>& cells, TaskScheduler& scheduler);
+
+		// linear cell index, -1 outside the grid
+		int FindCell(const glm::ivec3& cell) const {
+			if (0 <= cell.x && cell.x < dims.x &&
+				0 <= cell.y && cell.y < dims.y &&
+				0 <= cell.z && cell.z < dims.z) {
+				return cell.z * dims.y * dims.x + cell.y * dims.x + cell.x;
+			}
+			return -1;
+		}
+		glm::ivec3 CellPos(int cell) const {
+			return glm::ivec3(cell % dims.x, (cell / dims.x) % dims.y, cell / (dims.x * dims.y));
+		}
+		// fn(cell) for every existing cell of the 3x3x3 block around center
+		template <typename F>
+		void ForEachNeighborCell(const glm::ivec3& center, F&& fn) const {
+			for (int x = -1; x <= 1; x++) {
+				for (int y = -1; y <= 1; y++) {
+					for (int z = -1; z <= 1; z++) {
+						int cell = FindCell(center + glm::ivec3(x, y, z));
+						if (cell >= 0) {
+							fn(cell);
+						}
+					}
+				}
+			}
+		}
+		int NumCells() const { return (int)cellStart.size(); }
+		int CellStart(int cell) const { return cellStart[cell]; }
+		int CellCount(int cell) const { return cellCount[cell]; }
+		int Particle(int k) const { return sortedIndices[k]; }
+
+	private:
+		glm::ivec3 dims;
+		std::vector<int> keys;
+		std::vector<int> cellStart;
+		std::vector<int> cellCount;
+		std::vector<int> sortedIndices;
+
+		// parallel build only: rank of each particle within its cell
+		std::vector<int> slot;
+		std::vector<std::atomic<int>> cellFill;
+	};
+
+	// sparse cell list for big or unbounded domains: only occupied cells are stored,
+	// found through an open addressing hash on the packed cell coordinate.
+	// particles are sorted by cell key, so cells are ranges of sortedIndices just like CellList
+	class HashedCellList {
+	public:
+		void resize(int particles);
+		void clear();
+
+		void Build(const std::vector<glm::ivec3>& cells, TaskScheduler& scheduler);
+
+		// occupied cell slot, -1 if the cell is empty
+		int FindCell(const glm::ivec3& cell) const {
+			uint64_t key = PackKey(cell);
+			size_t h = Hash(key) & tableMask;
+			for (;;) {
+				int slot = table[h];
+				if (slot < 0) {
+					return -1;
+				}
+				if (cellKey[slot] == key) {
+					return slot;
+				}
+				h = (h + 1) & tableMask;
+			}
+		}
+		glm::ivec3 CellPos(int cell) const { return UnpackKey(cellKey[cell]); }
+		// fn(cell) for every occupied cell of the 3x3x3 block around center, same
+		// order as CellList. the block of each occupied cell is resolved once per build
+		template <typename F>
+		void ForEachNeighborCell(const glm::ivec3& center, F&& fn) const {
+			int own = FindCell(center);
+			if (own >= 0) {
+				const int* block = &cellNeighbors[own * 27];
+				for (int b = 0; b < 27; ++b) {
+					if (block[b] >= 0) {
+						fn(block[b]);
+					}
+				}
+				return;
+			}
+			for (int x = -1; x <= 1; x++) {
+				for (int y = -1; y <= 1; y++) {
+					for (int z = -1; z <= 1; z++) {
+						int cell = FindCell(center + glm::ivec3(x, y, z));
+						if (cell >= 0) {
+							fn(cell);
+						}
+					}
+				}
+			}
+		}
+		int NumCells() const { return (int)cellStart.size(); }
+		int CellStart(int cell) const { return cellStart[cell]; }
+		int CellCount(int cell) const { return cellCount[cell]; }
+		int Particle(int k) const { return sortedIndices[k]; }
+
+	private:
+		// 21 bits per axis, cells further than ~1M from the origin alias but the
+		// distance test in the neighbor search still rejects them
+		static uint64_t PackKey(const glm::ivec3& c) {
+			const uint64_t mask = (1u << 21) - 1;
+			const int bias = 1 << 20;
+			return ((uint64_t)((c.z + bias) & mask) << 42) |
+				((uint64_t)((c.y + bias) & mask) << 21) |
+				(uint64_t)((c.x + bias) & mask);
+		}
+		static glm::ivec3 UnpackKey(uint64_t key) {
+			const uint64_t mask = (1u << 21) - 1;
+			const int bias = 1 << 20;
+			return glm::ivec3((int)(key & mask) - bias, (int)((key >> 21) & mask) - bias, (int)(key >> 42) - bias);
+		}
+		static size_t Hash(uint64_t key) {
+			key ^= key >> 33;
+			key *= 0xff51afd7ed558ccdULL;
+			key ^= key >> 33;
+			return (size_t)key;
+		}
+
+		struct Entry {
+			uint64_t key;
+			int index;
+			bool operator<(const Entry& o) const { return key < o.key || (key == o.key && index < o.index); }
+		};
+		std::vector<Entry> entries;
+
+		std::vector<uint64_t> cellKey;
+		std::vector<int> cellStart;
+		std::vector<int> cellCount;
+		std::vector<int> sortedIndices;
+		// 27 neighbor slots (or -1) per occupied cell
+		std::vector<int> cellNeighbors;
+
+		std::vector<int> table;
+		size_t tableMask;
+	};
+#endif
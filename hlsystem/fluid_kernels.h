@@ -0,0 +1,131 @@
+#ifndef DEF_FLUID_KERNELS
+	#define DEF_FLUID_KERNELS
+
+	#include <cmath>
+	#include <glm/glm.hpp>
+
+	// smoothing kernels as policies. setRadius computes the normalisation once, W
+	// takes the squared distance so density sums never need a sqrt. everything is
+	// zero outside h and for coincident points, so a particle never sees itself
+
+	// poly6, Mueller et al. 2003
+	struct Poly6Kernel {
+		double h2;
+		double coef;
+
+		void setRadius(double h) {
+			h2 = h * h;
+			coef = 315.0 / (64.0 * 3.141592 * pow(h, 9));
+		}
+		double W(double r2) const {
+			if (r2 > h2 || r2 == 0.0) {
+				return 0.0;
+			}
+			double c = h2 - r2;
+			return c * c * c * coef;
+		}
+	};
+
+	// spiky gradient, does not vanish near the center so close pairs still push apart
+	struct SpikyKernel {
+		double h;
+		double coef;
+
+		void setRadius(double radius) {
+			h = radius;
+			coef = -45.0 / (3.141592 * pow(radius, 6));
+		}
+		glm::dvec3 Grad(const glm::dvec3& r, double r2) const {
+			double dist = sqrt(r2);
+			if (dist > h || dist == 0.0) {
+				return glm::dvec3(0.0);
+			}
+			return r * coef * ((h - dist) * (h - dist) / dist);
+		}
+	};
+
+	// wendland c2 (3d), one kernel for density and gradient. the gradient has no
+	// 1 / |r| term and the polynomial is short, so it is the cheap option
+	struct WendlandKernel {
+		double h;
+		double invH;
+		double coef;		// 21 / (2 pi h^3)
+		double gradCoef;	// -210 / (pi h^5)
+
+		void setRadius(double radius) {
+			h = radius;
+			invH = 1.0 / radius;
+			coef = 21.0 / (2.0 * 3.141592 * pow(radius, 3));
+			gradCoef = -210.0 / (3.141592 * pow(radius, 5));
+		}
+		double W(double r2) const {
+			if (r2 > h * h || r2 == 0.0) {
+				return 0.0;
+			}
+			double q = sqrt(r2) * invH;
+			double a = 1.0 - q;
+			double a2 = a * a;
+			return a2 * a2 * (1.0 + 4.0 * q) * coef;
+		}
+		glm::dvec3 Grad(const glm::dvec3& r, double r2) const {
+			if (r2 > h * h || r2 == 0.0) {
+				return glm::dvec3(0.0);
+			}
+			double a = 1.0 - sqrt(r2) * invH;
+			return r * (gradCoef * a * a * a);
+		}
+	};
+
+	// density a particle sees on a cubic lattice of spacing h / 2, which is how the
+	// SOP seeds points. used to carry REST_DENSITY (tuned for poly6) over to other kernels
+	template <typename K>
+	inline double LatticeDensity(const K& kernel, double h) {
+		double spacing = 0.5 * h;
+		double sum = 0.0;
+		for (int x = -2; x <= 2; ++x) {
+			for (int y = -2; y <= 2; ++y) {
+				for (int z = -2; z <= 2; ++z) {
+					sum += kernel.W((x * x + y * y + z * z) * spacing * spacing);
+				}
+			}
+		}
+		return sum;
+	}
+
+	// the density / gradient pairs the solver stages are instantiated over, with the
+	// rest density that matches them
+	struct PbfKernels {
+		Poly6Kernel density;
+		SpikyKernel gradient;
+		double scorrDen;	// W(0.2 h), reference for the tensile instability term
+		double restDensity;
+
+		void setRadius(double h, double rest) {
+			density.setRadius(h);
+			gradient.setRadius(h);
+			scorrDen = density.W(0.04 * h * h);
+			restDensity = rest;
+		}
+	};
+
+	struct WendlandKernels {
+		WendlandKernel density;
+		WendlandKernel gradient;
+		double scorrDen;
+		double restDensity;
+
+		void setRadius(double h, double rest) {
+			density.setRadius(h);
+			gradient = density;
+			scorrDen = density.W(0.04 * h * h);
+			Poly6Kernel poly6;
+			poly6.setRadius(h);
+			restDensity = rest * LatticeDensity(density, h) / LatticeDensity(poly6, h);
+		}
+	};
+
+	enum class KernelType {
+		Poly6Spiky,
+		Wendland
+	};
+#endif
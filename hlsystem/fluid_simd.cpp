@@ -0,0 +1,88 @@
+#include <glm/simd/platform.h>
+
+#include "fluid_simd.h"
+
+#if GLM_ARCH & GLM_ARCH_X86_BIT
+	#if GLM_COMPILER & GLM_COMPILER_VC
+		#include <intrin.h>
+	#else
+		#include <cpuid.h>
+	#endif
+
+static void Cpuid(int leaf, int sub, unsigned int regs[4]) {
+	#if GLM_COMPILER & GLM_COMPILER_VC
+	int r[4];
+	__cpuidex(r, leaf, sub);
+	for (int i = 0; i < 4; ++i) {
+		regs[i] = (unsigned int)r[i];
+	}
+	#else
+	__cpuid_count(leaf, sub, regs[0], regs[1], regs[2], regs[3]);
+	#endif
+}
+
+static unsigned long long Xgetbv() {
+	#if GLM_COMPILER & GLM_COMPILER_VC
+	return _xgetbv(0);
+	#else
+	unsigned int eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+	#endif
+}
+
+SimdLevel DetectSimdLevel() {
+	unsigned int regs[4];
+	Cpuid(0, 0, regs);
+	if (regs[0] < 7) {
+		return SimdLevel::Scalar;
+	}
+
+	Cpuid(1, 0, regs);
+	bool osxsave = (regs[2] & (1u << 27)) != 0;
+	bool avx = (regs[2] & (1u << 28)) != 0;
+	bool fma = (regs[2] & (1u << 12)) != 0;
+	if (!osxsave || !avx || !fma) {
+		return SimdLevel::Scalar;
+	}
+	// the os has to save the ymm (and for avx512 the zmm / opmask) state
+	unsigned long long xcr0 = Xgetbv();
+	if ((xcr0 & 0x6) != 0x6) {
+		return SimdLevel::Scalar;
+	}
+
+	Cpuid(7, 0, regs);
+	bool avx2 = (regs[1] & (1u << 5)) != 0;
+	bool avx512f = (regs[1] & (1u << 16)) != 0;
+	if (avx2 && avx512f && (xcr0 & 0xe6) == 0xe6) {
+		return SimdLevel::AVX512;
+	}
+	return avx2 ? SimdLevel::AVX2 : SimdLevel::Scalar;
+}
+#else
+SimdLevel DetectSimdLevel() {
+	return SimdLevel::Scalar;
+}
+#endif
+
+const char* SimdLevelName(SimdLevel level) {
+	switch (level) {
+	case SimdLevel::AVX2: return "avx2";
+	case SimdLevel::AVX512: return "avx512";
+	default: return "scalar";
+	}
+}
+
+const PbfSimdKernelSet* GetPbfSimdKernels(SimdLevel level) {
+	switch (level) {
+	case SimdLevel::AVX512:
+		if (const PbfSimdKernelSet* kernels = GetPbfKernelsAVX512()) {
+			return kernels;
+		}
+		return GetPbfKernelsAVX2();
+	case SimdLevel::AVX2:
+		return GetPbfKernelsAVX2();
+	default:
+		return nullptr;
+	}
+}
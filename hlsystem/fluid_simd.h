@@ -0,0 +1,60 @@
+#ifndef DEF_FLUID_SIMD
+	#define DEF_FLUID_SIMD
+
+	enum class SimdLevel {
+		Scalar,
+		AVX2,
+		AVX512
+	};
+
+	// inputs and outputs of the pbf (poly6 density / spiky gradient) neighbor loops
+	// as plain arrays, so the vector translation units never include glm or std headers.
+	// Real is the storage type, the arithmetic is double for both
+	template <typename Real>
+	struct PbfSimdArgs {
+		const Real* pos;		// xyz per particle
+		const int* offsets;		// csr neighbor lists
+		const int* indices;
+
+		double radius;
+		double polyCoef;		// 315 / (64 pi h^9)
+		double spikyCoef;		// -45 / (pi h^6)
+		double polyDen;			// W(0.2 h) for the scorr term
+		double restDensity;
+		double relaxation;
+		double kCorr;
+
+		Real* density;
+		Real* lambda;
+		Real* deltaPos;			// xyz per particle
+	};
+
+	template <typename Real>
+	struct PbfSimdKernels {
+		void (*density)(const PbfSimdArgs<Real>& args, int begin, int end);
+		void (*lambda)(const PbfSimdArgs<Real>& args, int begin, int end);
+		void (*corrections)(const PbfSimdArgs<Real>& args, int begin, int end);
+		// corrections without the scorr term, for kCorr == 0
+		void (*plainCorrections)(const PbfSimdArgs<Real>& args, int begin, int end);
+	};
+
+	// one table per storage precision
+	struct PbfSimdKernelSet {
+		PbfSimdKernels<double> f64;
+		PbfSimdKernels<float> f32;
+
+		const PbfSimdKernels<double>& For(double) const { return f64; }
+		const PbfSimdKernels<float>& For(float) const { return f32; }
+	};
+
+	// best level the cpu and os support, checked with cpuid / xgetbv
+	SimdLevel DetectSimdLevel();
+	const char* SimdLevelName(SimdLevel level);
+	// nullptr for Scalar, or when that level was not compiled in
+	const PbfSimdKernelSet* GetPbfSimdKernels(SimdLevel level);
+
+	// defined in fluid_simd_avx2.cpp / fluid_simd_avx512.cpp, which are built with
+	// the matching instruction set flags and return nullptr when those are missing
+	const PbfSimdKernelSet* GetPbfKernelsAVX2();
+	const PbfSimdKernelSet* GetPbfKernelsAVX512();
+#endif
@@ -0,0 +1,66 @@
+// built with /arch:AVX2 (msvc) or -mavx2 -mfma, only called after DetectSimdLevel
+// saw avx2 at runtime. keep std / glm headers out of here, any inline function
+// compiled with avx2 could be picked by the linker for the scalar build too.
+#include "fluid_simd.h"
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+	#include "fluid_simd_kernels.h"
+
+namespace {
+	struct Avx2Double {
+		typedef __m256d V;
+		typedef __m256d M;
+		typedef __m128i I;
+		enum { W = 4 };
+
+		static I Indices(const int* p, int count, int fill) {
+			if (count >= W) {
+				return _mm_loadu_si128((const __m128i*)p);
+			}
+			int tail[W] = { fill, fill, fill, fill };
+			for (int k = 0; k < count; ++k) {
+				tail[k] = p[k];
+			}
+			return _mm_loadu_si128((const __m128i*)tail);
+		}
+		static V Gather(const double* base, I idx, int scale, int offset) {
+			if (scale != 1) {
+				idx = _mm_mullo_epi32(idx, _mm_set1_epi32(scale));
+			}
+			return _mm256_i32gather_pd(base + offset, idx, 8);
+		}
+		static V Gather(const float* base, I idx, int scale, int offset) {
+			if (scale != 1) {
+				idx = _mm_mullo_epi32(idx, _mm_set1_epi32(scale));
+			}
+			return _mm256_cvtps_pd(_mm_i32gather_ps(base + offset, idx, 4));
+		}
+
+		static V Set1(double x) { return _mm256_set1_pd(x); }
+		static V Zero() { return _mm256_setzero_pd(); }
+		static V Add(V a, V b) { return _mm256_add_pd(a, b); }
+		static V Sub(V a, V b) { return _mm256_sub_pd(a, b); }
+		static V Mul(V a, V b) { return _mm256_mul_pd(a, b); }
+		static V Div(V a, V b) { return _mm256_div_pd(a, b); }
+		static V Sqrt(V a) { return _mm256_sqrt_pd(a); }
+		static M Le(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+		static M Ne(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_NEQ_OQ); }
+		static M And(M a, M b) { return _mm256_and_pd(a, b); }
+		// blend rather than multiply so nan / inf from rejected lanes cannot leak
+		static V Select(M m, V a) { return _mm256_blendv_pd(_mm256_setzero_pd(), a, m); }
+		static double Sum(V a) {
+			__m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+			return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+		}
+	};
+}
+
+const PbfSimdKernelSet* GetPbfKernelsAVX2() {
+	return PbfLanes<Avx2Double>::Table();
+}
+#else
+const PbfSimdKernelSet* GetPbfKernelsAVX2() {
+	return nullptr;
+}
+#endif
@@ -0,0 +1,59 @@
+// built with /arch:AVX512 (msvc) or -mavx512f, only called after DetectSimdLevel
+// saw avx512f at runtime. same rule as fluid_simd_avx2.cpp: no std / glm headers.
+#include "fluid_simd.h"
+
+#if defined(__AVX512F__)
+	#include <immintrin.h>
+	#include "fluid_simd_kernels.h"
+
+namespace {
+	struct Avx512Double {
+		typedef __m512d V;
+		typedef __mmask8 M;
+		typedef __m256i I;
+		enum { W = 8 };
+
+		static I Indices(const int* p, int count, int fill) {
+			if (count >= W) {
+				return _mm256_loadu_si256((const __m256i*)p);
+			}
+			// masked 512 bit load so this stays avx512f only (no vl)
+			__mmask16 live = (__mmask16)((1u << count) - 1u);
+			return _mm512_castsi512_si256(_mm512_mask_loadu_epi32(_mm512_set1_epi32(fill), live, p));
+		}
+		static V Gather(const double* base, I idx, int scale, int offset) {
+			if (scale != 1) {
+				idx = _mm256_mullo_epi32(idx, _mm256_set1_epi32(scale));
+			}
+			return _mm512_i32gather_pd(idx, base + offset, 8);
+		}
+		static V Gather(const float* base, I idx, int scale, int offset) {
+			if (scale != 1) {
+				idx = _mm256_mullo_epi32(idx, _mm256_set1_epi32(scale));
+			}
+			return _mm512_cvtps_pd(_mm256_i32gather_ps(base + offset, idx, 4));
+		}
+
+		static V Set1(double x) { return _mm512_set1_pd(x); }
+		static V Zero() { return _mm512_setzero_pd(); }
+		static V Add(V a, V b) { return _mm512_add_pd(a, b); }
+		static V Sub(V a, V b) { return _mm512_sub_pd(a, b); }
+		static V Mul(V a, V b) { return _mm512_mul_pd(a, b); }
+		static V Div(V a, V b) { return _mm512_div_pd(a, b); }
+		static V Sqrt(V a) { return _mm512_sqrt_pd(a); }
+		static M Le(V a, V b) { return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ); }
+		static M Ne(V a, V b) { return _mm512_cmp_pd_mask(a, b, _CMP_NEQ_OQ); }
+		static M And(M a, M b) { return (M)(a & b); }
+		static V Select(M m, V a) { return _mm512_maskz_mov_pd(m, a); }
+		static double Sum(V a) { return _mm512_reduce_add_pd(a); }
+	};
+}
+
+const PbfSimdKernelSet* GetPbfKernelsAVX512() {
+	return PbfLanes<Avx512Double>::Table();
+}
+#else
+const PbfSimdKernelSet* GetPbfKernelsAVX512() {
+	return nullptr;
+}
+#endif
@@ -0,0 +1,149 @@
+#ifndef DEF_FLUID_SIMD_KERNELS
+	#define DEF_FLUID_SIMD_KERNELS
+
+	#include "fluid_simd.h"
+
+	// vector bodies of the pbf neighbor loops, written once against a lane type L
+	// and instantiated by fluid_simd_avx2.cpp / fluid_simd_avx512.cpp. everything
+	// sits in an anonymous namespace so copies built with different instruction
+	// sets never get merged by the linker.
+	//
+	// L provides V (W doubles), M (lane mask), I (W int32 indices) and
+	//   Indices(p, count, fill)	load min(count, W) neighbor indices, pad with fill
+	//   Gather(base, idx, scale, offset)	base[idx * scale + offset] per lane, widened
+	//   to double when base is float
+	//   Set1, Zero, Add, Sub, Mul, Div, Sqrt, Le, Ne, And, Select (zero off lanes), Sum
+	// padding uses the particle itself, whose distance of 0 is rejected exactly like
+	// the scalar path rejects it, so no separate tail loop is needed.
+	namespace {
+		template <class L>
+		struct PbfLanes {
+			typedef typename L::V V;
+			typedef typename L::M M;
+			typedef typename L::I I;
+
+			template <typename Real>
+			static void Density(const PbfSimdArgs<Real>& a, int begin, int end) {
+				const V h2 = L::Set1(a.radius * a.radius);
+				const V coef = L::Set1(a.polyCoef);
+				const V zero = L::Zero();
+
+				for (int i = begin; i < end; ++i) {
+					const V px = L::Set1(a.pos[3 * i]);
+					const V py = L::Set1(a.pos[3 * i + 1]);
+					const V pz = L::Set1(a.pos[3 * i + 2]);
+					V acc = zero;
+
+					for (int k = a.offsets[i], kEnd = a.offsets[i + 1]; k < kEnd; k += L::W) {
+						I idx = L::Indices(a.indices + k, kEnd - k, i);
+						V rx = L::Sub(px, L::Gather(a.pos, idx, 3, 0));
+						V ry = L::Sub(py, L::Gather(a.pos, idx, 3, 1));
+						V rz = L::Sub(pz, L::Gather(a.pos, idx, 3, 2));
+						V r2 = L::Add(L::Add(L::Mul(rx, rx), L::Mul(ry, ry)), L::Mul(rz, rz));
+
+						M in = L::And(L::Le(r2, h2), L::Ne(r2, zero));
+						V c = L::Sub(h2, r2);
+						acc = L::Add(acc, L::Select(in, L::Mul(L::Mul(L::Mul(c, c), c), coef)));
+					}
+					a.density[i] = (Real)L::Sum(acc);
+				}
+			}
+
+			template <typename Real>
+			static void Lambda(const PbfSimdArgs<Real>& a, int begin, int end) {
+				const V h = L::Set1(a.radius);
+				const V coef = L::Set1(a.spikyCoef);
+				const V rest = L::Set1(a.restDensity);
+				const V zero = L::Zero();
+
+				for (int i = begin; i < end; ++i) {
+					const V px = L::Set1(a.pos[3 * i]);
+					const V py = L::Set1(a.pos[3 * i + 1]);
+					const V pz = L::Set1(a.pos[3 * i + 2]);
+					V sumGradients = zero;
+					V gx = zero, gy = zero, gz = zero;
+
+					for (int k = a.offsets[i], kEnd = a.offsets[i + 1]; k < kEnd; k += L::W) {
+						I idx = L::Indices(a.indices + k, kEnd - k, i);
+						V rx = L::Sub(px, L::Gather(a.pos, idx, 3, 0));
+						V ry = L::Sub(py, L::Gather(a.pos, idx, 3, 1));
+						V rz = L::Sub(pz, L::Gather(a.pos, idx, 3, 2));
+						V dist = L::Sqrt(L::Add(L::Add(L::Mul(rx, rx), L::Mul(ry, ry)), L::Mul(rz, rz)));
+
+						M in = L::And(L::Le(dist, h), L::Ne(dist, zero));
+						V hd = L::Sub(h, dist);
+						V s = L::Div(L::Mul(hd, hd), dist);
+						rx = L::Select(in, L::Div(L::Mul(L::Mul(rx, coef), s), rest));
+						ry = L::Select(in, L::Div(L::Mul(L::Mul(ry, coef), s), rest));
+						rz = L::Select(in, L::Div(L::Mul(L::Mul(rz, coef), s), rest));
+
+						sumGradients = L::Add(sumGradients, L::Add(L::Add(L::Mul(rx, rx), L::Mul(ry, ry)), L::Mul(rz, rz)));
+						gx = L::Add(gx, rx);
+						gy = L::Add(gy, ry);
+						gz = L::Add(gz, rz);
+					}
+
+					double sx = L::Sum(gx), sy = L::Sum(gy), sz = L::Sum(gz);
+					double sum = L::Sum(sumGradients) + sx * sx + sy * sy + sz * sz;
+					a.lambda[i] = (Real)(-(a.density[i] / a.restDensity - 1.0) / (sum + a.relaxation));
+				}
+			}
+
+			template <typename Real, bool Tensile>
+			static void Corrections(const PbfSimdArgs<Real>& a, int begin, int end) {
+				const V h = L::Set1(a.radius);
+				const V h2 = L::Set1(a.radius * a.radius);
+				const V polyCoef = L::Set1(a.polyCoef);
+				const V spikyCoef = L::Set1(a.spikyCoef);
+				const V polyDen = L::Set1(a.polyDen);
+				const V negK = L::Set1(-a.kCorr);
+				const V rest = L::Set1(a.restDensity);
+				const V zero = L::Zero();
+
+				for (int i = begin; i < end; ++i) {
+					const V px = L::Set1(a.pos[3 * i]);
+					const V py = L::Set1(a.pos[3 * i + 1]);
+					const V pz = L::Set1(a.pos[3 * i + 2]);
+					const V li = L::Set1(a.lambda[i]);
+					V dx = zero, dy = zero, dz = zero;
+
+					for (int k = a.offsets[i], kEnd = a.offsets[i + 1]; k < kEnd; k += L::W) {
+						I idx = L::Indices(a.indices + k, kEnd - k, i);
+						V rx = L::Sub(px, L::Gather(a.pos, idx, 3, 0));
+						V ry = L::Sub(py, L::Gather(a.pos, idx, 3, 1));
+						V rz = L::Sub(pz, L::Gather(a.pos, idx, 3, 2));
+						V lj = L::Gather(a.lambda, idx, 1, 0);
+						V r2 = L::Add(L::Add(L::Mul(rx, rx), L::Mul(ry, ry)), L::Mul(rz, rz));
+						V dist = L::Sqrt(r2);
+
+						M in = L::And(L::Le(dist, h), L::Ne(dist, zero));
+						V scale = L::Add(li, lj);
+						if (Tensile) {
+							V c = L::Sub(h2, r2);
+							V frac = L::Div(L::Mul(L::Mul(L::Mul(c, c), c), polyCoef), polyDen);
+							V sCorr = L::Mul(L::Mul(L::Mul(L::Mul(negK, frac), frac), frac), frac);
+							scale = L::Add(scale, sCorr);
+						}
+
+						V hd = L::Sub(h, dist);
+						V s = L::Div(L::Mul(hd, hd), dist);
+						dx = L::Add(dx, L::Select(in, L::Mul(L::Div(L::Mul(L::Mul(rx, spikyCoef), s), rest), scale)));
+						dy = L::Add(dy, L::Select(in, L::Mul(L::Div(L::Mul(L::Mul(ry, spikyCoef), s), rest), scale)));
+						dz = L::Add(dz, L::Select(in, L::Mul(L::Div(L::Mul(L::Mul(rz, spikyCoef), s), rest), scale)));
+					}
+					a.deltaPos[3 * i] = (Real)L::Sum(dx);
+					a.deltaPos[3 * i + 1] = (Real)L::Sum(dy);
+					a.deltaPos[3 * i + 2] = (Real)L::Sum(dz);
+				}
+			}
+
+			static const PbfSimdKernelSet* Table() {
+				static const PbfSimdKernelSet table = {
+					{ &Density<double>, &Lambda<double>, &Corrections<double, true>, &Corrections<double, false> },
+					{ &Density<float>, &Lambda<float>, &Corrections<float, true>, &Corrections<float, false> }
+				};
+				return &table;
+			}
+		};
+	}
+#endif
@@ -0,0 +1,98 @@
+#ifndef DEF_FLUID_STATS
+	#define DEF_FLUID_STATS
+
+	#include <chrono>
+	#include <vector>
+
+	// 0 compiles every timer and counter out of FluidSystem::Run, the stats
+	// api stays but reads zeros
+	#ifndef FLUID_STATS
+		#define FLUID_STATS 1
+	#endif
+
+	// wall seconds of the four stages of one constraint iteration
+	struct IterationTimes {
+		double density = 0.0;
+		double lambda = 0.0;
+		double corrections = 0.0;
+		double apply = 0.0;
+
+		double total() const { return density + lambda + corrections + apply; }
+		IterationTimes& operator+=(const IterationTimes& o) {
+			density += o.density;
+			lambda += o.lambda;
+			corrections += o.corrections;
+			apply += o.apply;
+			return *this;
+		}
+	};
+
+	// stage times summed over every step since the last reset, counters describe the latest step
+	struct SolverStats {
+		double reorder = 0.0;
+		double predict = 0.0;
+		double neighbors = 0.0;
+		double warmStart = 0.0;
+		// iterations[k] sums the k-th constraint iteration of every step
+		std::vector<IterationTimes> iterations;
+		double velocity = 0.0;
+		double vorticity = 0.0;
+		double viscosity = 0.0;
+		int steps = 0;
+		// constraint iterations over those steps, they vary once a tolerance is set
+		int constraintIterations = 0;
+
+		// neighbor list lengths, skin included, as of the last rebuild
+		double avgNeighbors = 0.0;
+		int maxNeighbors = 0;
+		int occupiedCells = 0;
+		// particles the box pushed back during the last predict
+		int clampedParticles = 0;
+		// mean and worst compression max(density / rest - 1, 0) going into the last
+		// constraint iteration of the last step
+		double avgDensityError = 0.0;
+		double maxDensityError = 0.0;
+
+		IterationTimes constraints() const {
+			IterationTimes sum;
+			for (const IterationTimes& t : iterations) {
+				sum += t;
+			}
+			return sum;
+		}
+		double total() const {
+			return reorder + predict + neighbors + warmStart + constraints().total() + velocity + vorticity + viscosity;
+		}
+	};
+
+	// laps a wall clock between stages, empty when stats are compiled out
+	class StageClock {
+	public:
+	#if FLUID_STATS
+		StageClock() : running(false) {}
+		void start(bool enable) {
+			running = enable;
+			if (running) {
+				last = std::chrono::steady_clock::now();
+			}
+		}
+		// adds the time since the previous lap to total
+		void lap(double& total) {
+			if (running) {
+				std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+				total += std::chrono::duration<double>(now - last).count();
+				last = now;
+			}
+		}
+		bool isRunning() const { return running; }
+
+	private:
+		bool running;
+		std::chrono::steady_clock::time_point last;
+	#else
+		void start(bool) {}
+		void lap(double&) {}
+		bool isRunning() const { return false; }
+	#endif
+	};
+#endif
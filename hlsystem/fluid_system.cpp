@@ -20,35 +20,57 @@
   3. This notice may not be removed or altered from any source distribution.
 */
 
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
 #include <glm/gtx/norm.hpp>
 #include <glm/gtx/string_cast.hpp>
 
 #include "fluid_system.h"
+#include "fluid_trace.h"
 
 FluidSystem::FluidSystem() :
+	stepCount(0),
 	myIteration(2),
+	densityTolerance(0.0),
+	minIterations(MIN_CONSTRAINT_ITERATIONS),
+	maxIterations(MAX_CONSTRAINT_ITERATIONS),
+	lastIterations(0),
+	warmStart(false),
+	warmDamping(WARM_START_DAMPING),
+	avgDensityError(0.0),
+	maxDensityError(0.0),
 	viscConst(0.01),
 	vortConst(0.0003),
-	kCorr(0.0001)
-{}
-
-double FluidSystem::PolyKernel(double dist) {
-	if (dist > SPH_RADIUS || dist == 0) {
-		return 0.0;
-	}
-	double c = SPH_RADIUS * SPH_RADIUS - dist * dist;
-	double wPoly = 315.0 / (64.0 * 3.141592 * pow(SPH_RADIUS, 9));
-	return c * c * c * wPoly;
-}
-
-void FluidSystem::SpikyKernel(glm::dvec3& r) {
-	double dist = glm::length(r);
-	if (dist > SPH_RADIUS || dist == 0) {
-		r = glm::dvec3(0.0);
-		return;
+	kCorr(0.0001),
+	activeTerms(VorticityTerm | ViscosityTerm | TensileTerm),
+	frameTime(m_DT),
+	timeStep(m_DT),
+	cflNumber(0.0),
+	minTimeStep(MIN_TIME_STEP),
+	maxTimeStep(MAX_TIME_STEP),
+	lastSubsteps(0),
+	kernelType(KernelType::Poly6Spiky),
+	solveMode(SolveMode::Jacobi),
+	parallelGridBuild(true),
+	usePairCache(false),
+	pairTraversal(false),
+	fuseIterations(true),
+	verletSkin(0.0),
+	gridType(GridType::Auto),
+	useBoundary(true),
+	reorderInterval(REORDER_INTERVAL),
+	simdLevel(DetectSimdLevel()),
+	simdKernels(GetPbfSimdKernels(simdLevel)),
+	precision(Precision::Double),
+	collectStats(false)
+{
+	// the vector kernels read predictPos / deltaPos as packed xyz doubles
+	static_assert(sizeof(glm::dvec3) == 3 * sizeof(double), "dvec3 must be tightly packed");
+	if (!simdKernels) {
+		simdLevel = SimdLevel::Scalar;
 	}
-	r *= -45.0 / (3.141592 * pow(SPH_RADIUS, 6));
-	r *= (SPH_RADIUS - dist) * (SPH_RADIUS - dist) / dist;
 }
 
 void FluidSystem::setParameters(int ite, double visc, double vor, double tensile)
@@ -57,254 +79,1309 @@ void FluidSystem::setParameters(int ite, double visc, double vor, double tensile
 	viscConst = visc;
 	vortConst = vor;
 	kCorr = tensile;
+	activeTerms = (vor != 0.0 ? VorticityTerm : 0) | (visc != 0.0 ? ViscosityTerm : 0) |
+		(tensile != 0.0 ? TensileTerm : 0);
 }
 
-void FluidSystem::cleanUp()
+void FluidSystem::setConvergence(double tolerance, int minIters, int maxIters)
 {
-	if (fluidPs.size() > 0)
-	{
-		fluidPs.clear();
+	densityTolerance = tolerance > 0.0 ? tolerance : 0.0;
+	minIterations = std::max(1, minIters);
+	maxIterations = std::max(minIterations, maxIters);
+}
+
+void FluidSystem::setWarmStart(bool enable, double damping)
+{
+	if (enable && !warmStart) {
+		// nothing was recorded while it was off, a zero count starts a particle cold
+		std::fill(fluidPs.warmNeighbors.begin(), fluidPs.warmNeighbors.end(), 0);
+		std::fill(fluidPsF.warmNeighbors.begin(), fluidPsF.warmNeighbors.end(), 0);
 	}
-	if (grid.size() > 0)
-	{
-		grid.clear();
+	warmStart = enable;
+	warmDamping = glm::clamp(damping, 0.0, 1.0);
+}
+
+void FluidSystem::setFrameTime(double seconds)
+{
+	frameTime = seconds > 0.0 ? seconds : m_DT;
+}
+
+void FluidSystem::setAdaptiveStep(double cfl, double minStep, double maxStep)
+{
+	cflNumber = cfl > 0.0 ? cfl : 0.0;
+	minTimeStep = minStep > 0.0 ? minStep : MIN_TIME_STEP;
+	maxTimeStep = maxStep > minTimeStep ? maxStep : minTimeStep;
+}
+
+void FluidSystem::setThreadCount(int threads)
+{
+	scheduler.SetThreadCount(threads);
+}
+
+void FluidSystem::setParallelGridBuild(bool parallel)
+{
+	parallelGridBuild = parallel;
+}
+
+void FluidSystem::setPairCache(bool enable)
+{
+	usePairCache = enable;
+	if (!usePairCache) {
+		pairW.clear();
+		pairGradW.clear();
+	}
+}
+
+void FluidSystem::setPairTraversal(bool enable)
+{
+	if (enable != pairTraversal) {
+		pairTraversal = enable;
+		// the half lists and colors are built with the neighbor lists
+		neighborsDirty = true;
+	}
+	if (!pairTraversal) {
+		halfOffsets.clear();
+		halfIndices.clear();
+		pairDensity.clear();
+		pairGradNorm.clear();
+		pairVector.clear();
 	}
-	if (neighbors.size() > 0)
-	{
-		neighbors.clear();
+}
+
+void FluidSystem::setFusedIterations(bool enable)
+{
+	fuseIterations = enable;
+}
+
+void FluidSystem::setVerletSkin(double skin)
+{
+	verletSkin = skin;
+	if (NumPoints() > 0) {
+		SetupGrid();
+	}
+}
+
+void FluidSystem::setGridType(GridType type)
+{
+	gridType = type;
+	if (NumPoints() > 0) {
+		SetupGrid();
+	}
+}
+
+void FluidSystem::setBoundary(bool enabled)
+{
+	useBoundary = enabled;
+	if (NumPoints() > 0) {
+		SetupGrid();
+	}
+}
+
+void FluidSystem::setReorderInterval(int steps)
+{
+	reorderInterval = steps;
+}
+
+void FluidSystem::setSimdLevel(SimdLevel level)
+{
+	SimdLevel supported = DetectSimdLevel();
+	simdLevel = level < supported ? level : supported;
+	simdKernels = GetPbfSimdKernels(simdLevel);
+	if (!simdKernels) {
+		simdLevel = SimdLevel::Scalar;
+	}
+}
+
+void FluidSystem::setPrecision(Precision p)
+{
+	if (p == precision) {
+		return;
+	}
+	if (p == Precision::Float) {
+		fluidPsF.assign(fluidPs);
+		fluidPs.clear();
+	} else {
+		fluidPs.assign(fluidPsF);
+		fluidPsF.clear();
+	}
+	precision = p;
+}
+
+void FluidSystem::setCollectStats(bool enable)
+{
+	collectStats = enable;
+}
+
+void FluidSystem::setKernel(KernelType type)
+{
+	kernelType = type;
+}
+
+void FluidSystem::setSolveMode(SolveMode mode)
+{
+	if (mode != solveMode) {
+		solveMode = mode;
+		// the colors are built with the neighbor lists
+		neighborsDirty = true;
 	}
 }
 
+void FluidSystem::SetupKernels()
+{
+	pbfKernels.setRadius(SPH_RADIUS, REST_DENSITY);
+	wendlandKernels.setRadius(SPH_RADIUS, REST_DENSITY);
+}
+
+void FluidSystem::cleanUp()
+{
+	fluidPs.clear();
+	fluidPsF.clear();
+	grid.clear();
+	hashedGrid.clear();
+	cellCoords.clear();
+	neighborOffsets.clear();
+	neighborIndices.clear();
+	chunkNeighbors.clear();
+	colorParticles.clear();
+	colorCells.clear();
+	colorStart.clear();
+	halfOffsets.clear();
+	halfIndices.clear();
+	pairDensity.clear();
+	pairGradNorm.clear();
+	pairVector.clear();
+	buildPos.clear();
+	particleId.clear();
+	slotOf.clear();
+	pairW.clear();
+	pairGradW.clear();
+}
+
 // SET SPH_RADIUS BEFORE THIS!
 void FluidSystem::SPH_CreateExample(std::vector<glm::dvec3> p) {
 	cleanUp();
 
+	SetupKernels();
 	scaledMin = glm::dvec3(SPH_VOLMIN) * SPH_RADIUS;
 	scaledMax = glm::dvec3(SPH_VOLMAX) * SPH_RADIUS;
-	gridSpaceDiag = glm::ivec3((scaledMax - scaledMin) / SPH_RADIUS);
-	totalGridCells = gridSpaceDiag.x * gridSpaceDiag.y * gridSpaceDiag.z;
 
-	for (auto& pt : p) {
-		fluidPs.push_back(std::make_unique<Fluid>(pt * SPH_RADIUS));
+	Allocate(p.size());
+	int n = (int)p.size();
+	if (precision == Precision::Float) {
+		for (int i = 0; i < n; ++i) {
+			fluidPsF.pos[i] = glm::vec3(p[i] * SPH_RADIUS);
+		}
+	} else {
+		for (int i = 0; i < n; ++i) {
+			fluidPs.pos[i] = p[i] * SPH_RADIUS;
+		}
 	}
+	SetupGrid();
+}
 
-	grid.reserve(totalGridCells);
-	for (int _ = 0; _ < totalGridCells; ++_) {
-		std::vector<int>& gridIndices = std::vector<int>();
-		gridIndices.reserve(MAX_NEIGHBOR);
-		grid.push_back(gridIndices);
+void FluidSystem::Allocate(size_t n) {
+	if (precision == Precision::Float) {
+		fluidPsF.resize(n);
+	} else {
+		fluidPs.resize(n);
 	}
 
-	for (int i = 0; i < fluidPs.size(); ++i) {
-		neighbors.push_back(std::vector<int>());
+	cellCoords.resize(n);
+	neighborOffsets.assign(n + 1, 0);
+	neighborIndices.reserve(n * MAX_NEIGHBOR);
+	chunkNeighbors.resize((n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN);
+	buildPos.resize(n);
+
+	particleId.resize(n);
+	slotOf.resize(n);
+	for (int i = 0; i < (int)n; ++i) {
+		particleId[i] = i;
+		slotOf[i] = i;
 	}
+	stepsSinceReorder = 0;
+	stepCount = 0;
+	stats = SolverStats();
+	neighborGap = 0.0;
+	sortedNeighborGap = 0.0;
 }
 
-glm::ivec3 FluidSystem::GetGridPos(const glm::dvec3& pos) {
-	return glm::ivec3(pos / SPH_RADIUS - SPH_VOLMIN);
+void FluidSystem::SetupGrid() {
+	cellSize = SPH_RADIUS * (1.0 + verletSkin);
+	gridOrigin = SPH_VOLMIN * (SPH_RADIUS / cellSize);
+	glm::dvec3 extent = glm::ceil((scaledMax - scaledMin) / cellSize);
+	double denseCells = extent.x * extent.y * extent.z;
+
+	activeGrid = gridType;
+	if (!useBoundary || denseCells > INT_MAX) {
+		activeGrid = GridType::Hashed;
+	} else if (activeGrid == GridType::Auto) {
+		bool sparse = denseCells > (double)MAX_DENSE_CELLS_PER_PARTICLE * NumPoints();
+		activeGrid = sparse ? GridType::Hashed : GridType::Dense;
+	}
+
+	if (activeGrid == GridType::Dense) {
+		gridSpaceDiag = glm::ivec3(extent);
+		totalGridCells = gridSpaceDiag.x * gridSpaceDiag.y * gridSpaceDiag.z;
+		grid.resize(gridSpaceDiag, NumPoints());
+		hashedGrid.clear();
+	} else {
+		gridSpaceDiag = glm::ivec3(0);
+		totalGridCells = 0;
+		grid.clear();
+		hashedGrid.resize(NumPoints());
+	}
+	neighborsDirty = true;
 }
 
-int FluidSystem::GetGridIndex(const glm::ivec3& gridPos) {
-	return gridPos.z * gridSpaceDiag.y * gridSpaceDiag.x + gridPos.y * gridSpaceDiag.x + gridPos.x;
+glm::ivec3 FluidSystem::GetGridPos(const glm::dvec3& pos) {
+	return glm::ivec3(glm::floor(pos / cellSize - gridOrigin));
 }
 
 void FluidSystem::Run() {
-	PredictPositions();
-	FindNeighbors();
-	for (int _ = 0; _ < myIteration; ++_) {
-		ComputeDensity();
-		ComputeLambda();
-		ComputeCorrections();
-		ApplyCorrections();
+	// one run per frame, spans on every thread are tagged with it
+	Trace::SetFrame(stepCount);
+	TraceSpan span("frame", "solver");
+	if (precision == Precision::Float) {
+		Dispatch<float>();
+	} else {
+		Dispatch<double>();
+	}
+	++stepCount;
+}
+
+template <typename Real>
+void FluidSystem::Dispatch() {
+	double remaining = frameTime;
+	lastSubsteps = 0;
+	while (remaining > 0.0) {
+		timeStep = NextTimeStep<Real>(remaining);
+		if (kernelType == KernelType::Wendland) {
+			StepTerms<Real, WendlandKernels>();
+		} else {
+			StepTerms<Real, PbfKernels>();
+		}
+		// the last substep is handed exactly what was left
+		remaining = timeStep >= remaining ? 0.0 : remaining - timeStep;
+		++lastSubsteps;
+	}
+}
+
+template <typename Real, typename K>
+void FluidSystem::StepTerms() {
+	switch (activeTerms) {
+	case 0:
+		Step<SolverTraits<Real, K, false, false, false>>();
+		break;
+	case VorticityTerm:
+		Step<SolverTraits<Real, K, true, false, false>>();
+		break;
+	case ViscosityTerm:
+		Step<SolverTraits<Real, K, false, true, false>>();
+		break;
+	case VorticityTerm | ViscosityTerm:
+		Step<SolverTraits<Real, K, true, true, false>>();
+		break;
+	case TensileTerm:
+		Step<SolverTraits<Real, K, false, false, true>>();
+		break;
+	case VorticityTerm | TensileTerm:
+		Step<SolverTraits<Real, K, true, false, true>>();
+		break;
+	case ViscosityTerm | TensileTerm:
+		Step<SolverTraits<Real, K, false, true, true>>();
+		break;
+	default:
+		Step<SolverTraits<Real, K>>();
+		break;
+	}
+}
+
+template <typename Real>
+double FluidSystem::NextTimeStep(double remaining) {
+	if (cflNumber <= 0.0) {
+		return remaining;
 	}
-	Advance();
+	typedef typename FluidParticlesT<Real>::Vec3 Vec3;
+	const std::vector<Vec3>& vel = Particles(Real()).vel;
+	// fastest particle, per worker so the reduction needs no atomics
+	std::vector<double> fastest(scheduler.ThreadCount(), 0.0);
+	scheduler.ParallelForWorker((int)vel.size(), PARALLEL_GRAIN, [&](int begin, int end, int worker) {
+		double speed2 = 0.0;
+		for (int i = begin; i < end; ++i) {
+			speed2 = std::max(speed2, (double)glm::length2(glm::dvec3(vel[i])));
+		}
+		fastest[worker] = std::max(fastest[worker], speed2);
+	});
+	double speed = std::sqrt(*std::max_element(fastest.begin(), fastest.end()));
+	double dt = speed > 0.0 ? cflNumber * SPH_RADIUS / speed : maxTimeStep;
+	dt = glm::clamp(dt, minTimeStep, maxTimeStep);
+	// split what is left evenly rather than ending the frame on a sliver
+	double steps = std::ceil(remaining / dt - 1e-9);
+	return steps <= 1.0 ? remaining : remaining / steps;
 }
 
+template <typename S>
+void FluidSystem::Step() {
+	typedef typename S::Real Real;
+	TraceSpan span("step", "solver");
+	stageClock.start(collectStats);
+	if (NeedsReorder()) {
+		ReorderParticles<Real>();
+	}
+	++stepsSinceReorder;
+	stageClock.lap(stats.reorder);
+	PredictPositions<Real>();
+	stageClock.lap(stats.predict);
+	if (NeedsNeighborRebuild<Real>()) {
+		FindNeighbors<Real>();
+	}
+	stageClock.lap(stats.neighbors);
+	if (warmStart) {
+		WarmStart<Real>();
+	}
+	stageClock.lap(stats.warmStart);
+	bool converge = densityTolerance > 0.0;
+	int iterations = converge ? maxIterations : myIteration;
+	// the error was measured before this correction, so it only gets better
+	auto converged = [&](int done) {
+		return converge && done >= minIterations && avgDensityError < densityTolerance;
+	};
+	bool velocityDone = false;
+	lastIterations = 0;
+	for (int it = 0; it < iterations; ++it) {
+		IterationTimes times;
+		TraceSpan span("iteration", "solver", stepCount, it);
+		if (solveMode == SolveMode::GaussSeidel) {
+			// density, lambda and corrections interleave per cell, the sweep counts as corrections
+			ProjectColored<S>();
+			stageClock.lap(times.corrections);
+		} else if (fuseIterations && !PairTraversal()) {
+			// the two sweeps count as density and corrections
+			ComputeDensityLambda<S>();
+			stageClock.lap(times.density);
+			// the error is known now, so the last sweep can finish the positions as well
+			velocityDone = it + 1 == iterations || converged(lastIterations + 1);
+			ComputeCorrections<S>(true, velocityDone);
+			stageClock.lap(times.corrections);
+		} else {
+			ComputeDensity<S>();
+			stageClock.lap(times.density);
+			ComputeLambda<S>();
+			stageClock.lap(times.lambda);
+			ComputeCorrections<S>();
+			stageClock.lap(times.corrections);
+			ApplyCorrections<Real>();
+			stageClock.lap(times.apply);
+		}
+		RecordIteration(it, times);
+		++lastIterations;
+		if (converged(lastIterations)) {
+			break;
+		}
+	}
+	Advance<S>(velocityDone);
+#if FLUID_STATS
+	if (collectStats) {
+		++stats.steps;
+		stats.constraintIterations += lastIterations;
+		stats.avgDensityError = avgDensityError;
+		stats.maxDensityError = maxDensityError;
+	}
+#endif
+}
+
+bool FluidSystem::NeedsReorder() {
+	if (reorderInterval <= 0) {
+		return false;
+	}
+	if (stepsSinceReorder >= reorderInterval) {
+		return true;
+	}
+	// sortedNeighborGap is 0 until the first lists after a reorder have been measured
+	return sortedNeighborGap > 0.0 && neighborGap > REORDER_DEGRADATION * sortedNeighborGap;
+}
+
+template <typename Real>
+void FluidSystem::ReorderParticles() {
+	TraceSpan span("reorder", "solver");
+	FluidParticlesT<Real>& ps = Particles(Real());
+	int n = (int)ps.size();
+	std::vector<std::pair<uint64_t, int>> keys(n);
+	scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			keys[i] = std::make_pair(MortonKey(GetGridPos(glm::dvec3(ps.pos[i]))), i);
+		}
+	});
+	std::sort(keys.begin(), keys.end());
+
+	std::vector<int> order(n);
+	std::vector<int> ids(n);
+	for (int k = 0; k < n; ++k) {
+		order[k] = keys[k].second;
+		ids[k] = particleId[order[k]];
+		slotOf[ids[k]] = k;
+	}
+	particleId.swap(ids);
+	ps.permute(order);
+
+	stepsSinceReorder = 0;
+	sortedNeighborGap = 0.0;
+	neighborsDirty = true;
+}
+
+template <typename Real>
 void FluidSystem::PredictPositions() {
-	for (int i = 0; i < fluidPs.size(); ++i) {
-		std::unique_ptr<Fluid>& p = fluidPs.at(i);
-		glm::dvec3 deltaVel = FORCE * m_DT; // a * dt = change in v
+	TraceSpan span("predict", "solver");
+	typedef typename FluidParticlesT<Real>::Vec3 Vec3;
+	FluidParticlesT<Real>& ps = Particles(Real());
+	std::vector<Vec3>& pos = ps.pos;
+	std::vector<Vec3>& predictPos = ps.predictPos;
+	std::vector<Vec3>& vel = ps.vel;
+	glm::dvec3 deltaVel = FORCE * timeStep; // a * dt = change in v
+	// particles the box pushed back, per worker so counting needs no atomics
+	std::vector<int> clamped(FLUID_STATS && collectStats ? scheduler.ThreadCount() : 0, 0);
+
+	scheduler.ParallelForWorker((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end, int worker) {
+		int pushed = 0;
+		for (int i = begin; i < end; ++i) {
+			glm::dvec3 v = glm::dvec3(vel[i]);
 
-		// apply force to velocity (gravity)
-		p->vel += (double)GRAVITY_ON * deltaVel;
+			// apply force to velocity (gravity)
+			v += (double)GRAVITY_ON * deltaVel;
 
-		p->predictPos = p->pos + (p->vel * m_DT);
+			glm::dvec3 pred = glm::dvec3(pos[i]) + (v * timeStep);
 
 
-		// Perform collision detection and response
-		if (p->predictPos.y < scaledMin.y) { p->vel.y = 0.0; p->predictPos.y = scaledMin.y + 0.001; }
-		if (p->predictPos.y > scaledMax.y) { p->vel.y = 0.0; p->predictPos.y = scaledMax.y - 0.001; }
+			// Perform collision detection and response
+			if (useBoundary) {
+			#if FLUID_STATS
+				glm::dvec3 unclamped = pred;
+			#endif
+				if (pred.y < scaledMin.y) { v.y = 0.0; pred.y = scaledMin.y + 0.001; }
+				if (pred.y > scaledMax.y) { v.y = 0.0; pred.y = scaledMax.y - 0.001; }
 
-		if (p->predictPos.x < scaledMin.x) { p->vel.x = 0.0; p->predictPos.x = scaledMin.x + 0.001; }
-		if (p->predictPos.x > scaledMax.x) { p->vel.x = 0.0; p->predictPos.x = scaledMax.x - 0.001; }
+				if (pred.x < scaledMin.x) { v.x = 0.0; pred.x = scaledMin.x + 0.001; }
+				if (pred.x > scaledMax.x) { v.x = 0.0; pred.x = scaledMax.x - 0.001; }
+
+				if (pred.z < scaledMin.z) { v.z = 0.0; pred.z = scaledMin.z + 0.001; }
+				if (pred.z > scaledMax.z) { v.z = 0.0; pred.z = scaledMax.z - 0.001; }
+			#if FLUID_STATS
+				pushed += pred != unclamped;
+			#endif
+			}
+			vel[i] = Vec3(v);
+			predictPos[i] = Vec3(pred);
+		}
+		if (!clamped.empty()) {
+			clamped[worker] += pushed;
+		}
+	});
+	if (!clamped.empty()) {
+		stats.clampedParticles = 0;
+		for (int c : clamped) {
+			stats.clampedParticles += c;
+		}
+	}
+}
 
-		if (p->predictPos.z < scaledMin.z) { p->vel.z = 0.0; p->predictPos.z = scaledMin.z + 0.001; }
-		if (p->predictPos.z > scaledMax.z) { p->vel.z = 0.0; p->predictPos.z = scaledMax.z - 0.001; }
+template <typename Real>
+bool FluidSystem::NeedsNeighborRebuild() {
+	if (neighborsDirty || verletSkin <= 0.0) {
+		return true;
 	}
+	// rebuild once anything could have crossed from outside the skin to inside the radius
+	const FluidParticlesT<Real>& ps = Particles(Real());
+	double limit = 0.5 * verletSkin * SPH_RADIUS;
+	double limit2 = limit * limit;
+	std::atomic<bool> moved(false);
+	scheduler.ParallelFor((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+		for (int i = begin; i < end && !moved.load(std::memory_order_relaxed); ++i) {
+			if (glm::length2(glm::dvec3(ps.predictPos[i]) - buildPos[i]) > limit2) {
+				moved.store(true, std::memory_order_relaxed);
+			}
+		}
+	});
+	return moved;
 }
 
+template <typename Real>
 void FluidSystem::FindNeighbors() {
-	for (int i = 0; i < totalGridCells; ++i) {
-		grid.at(i).clear();
-	}
+	TraceSpan span("neighbors", "solver");
+	typedef typename FluidParticlesT<Real>::Vec3 Vec3;
+	double searchRadius = SPH_RADIUS * (1.0 + verletSkin);
+	const std::vector<Vec3>& predictPos = Particles(Real()).predictPos;
+	int n = (int)predictPos.size();
 
 	//equivalinet of insertgrid / update grid finding the postns within the grid
-	for (int i = 0; i < fluidPs.size(); ++i) {
-		glm::ivec3 gridPos = GetGridPos(fluidPs.at(i)->predictPos);
-		int gIndex = GetGridIndex(gridPos);
-
-		// this if shouldn't be necessary?
-		if (0 <= gIndex && gIndex < grid.size()) {
-			grid.at(gIndex).push_back(i); // maybe set a limit? (see MAX_NEIGHBOR)
-		}
-	}
-
-	// equiv. Finding the Neighbors
-	for (int i = 0; i < fluidPs.size(); ++i) {
-	neighbor_loop:
-		neighbors.at(i).clear(); // clear neighbors from prev.
-
-		std::unique_ptr<Fluid>& p = fluidPs.at(i);
-		glm::ivec3 gridPos = GetGridPos(p->predictPos);
-
-		int SEARCH_SIZE = 1;
-		// 2x2 neighborhood.
-		for (int x = -SEARCH_SIZE; x <= SEARCH_SIZE; x++) {
-			for (int y = -SEARCH_SIZE; y <= SEARCH_SIZE; y++) {
-				for (int z = -SEARCH_SIZE; z <= SEARCH_SIZE; z++) {
-					glm::ivec3 n = gridPos + glm::ivec3(x, y, z);
-					if (0 <= n.x && n.x < gridSpaceDiag.x &&
-						0 <= n.y && n.y < gridSpaceDiag.y &&
-						0 <= n.z && n.z < gridSpaceDiag.z) {
-						int gIndex = GetGridIndex(n);
-						for (int pIndex : grid.at(gIndex)) { // each 
-							std::unique_ptr<Fluid>& pcurr = fluidPs.at(pIndex);
-							double lenR = glm::length(p->predictPos - pcurr->predictPos);
-							if (lenR <= SPH_RADIUS) {
-								neighbors.at(i).push_back(pIndex);
-								//if (neighbors.at(i).size() >= MAX_NEIGHBOR) { goto neighbor_loop; }
-							}
-						}
-					}
+	scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			cellCoords[i] = GetGridPos(glm::dvec3(predictPos[i]));
+		}
+	});
+	if (activeGrid == GridType::Dense) {
+		if (parallelGridBuild && scheduler.ThreadCount() > 1) {
+			grid.BuildParallel(cellCoords, scheduler);
+		} else {
+			grid.Build(cellCoords);
+		}
+		GatherNeighbors<Real>(grid, searchRadius);
+		if (solveMode == SolveMode::GaussSeidel || PairTraversal()) {
+			BuildColors(grid);
+		}
+	} else {
+		hashedGrid.Build(cellCoords, scheduler);
+		GatherNeighbors<Real>(hashedGrid, searchRadius);
+		if (solveMode == SolveMode::GaussSeidel || PairTraversal()) {
+			BuildColors(hashedGrid);
+		}
+	}
+
+	neighborOffsets[0] = 0;
+	for (int i = 0; i < n; ++i) {
+		neighborOffsets[i + 1] += neighborOffsets[i];
+	}
+	neighborIndices.resize(neighborOffsets[n]);
+	scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int /*end*/) {
+		const std::vector<int>& found = chunkNeighbors[begin / PARALLEL_GRAIN];
+		std::copy(found.begin(), found.end(), neighborIndices.begin() + neighborOffsets[begin]);
+	});
+	if (PairTraversal()) {
+		BuildHalfLists();
+	}
+
+	buildPos.assign(predictPos.begin(), predictPos.end());
+	neighborsDirty = false;
+
+#if FLUID_STATS
+	if (collectStats) {
+		int most = 0;
+		for (int i = 0; i < n; ++i) {
+			most = std::max(most, neighborOffsets[i + 1] - neighborOffsets[i]);
+		}
+		stats.maxNeighbors = most;
+		stats.avgNeighbors = n > 0 ? (double)neighborOffsets[n] / n : 0.0;
+		if (activeGrid == GridType::Dense) {
+			int occupied = 0;
+			for (int c = 0; c < grid.NumCells(); ++c) {
+				occupied += grid.CellCount(c) > 0;
+			}
+			stats.occupiedCells = occupied;
+		} else {
+			// the hash only stores occupied cells
+			stats.occupiedCells = hashedGrid.NumCells();
+		}
+	}
+#endif
+
+	if (reorderInterval > 0) {
+		// locality measure for NeedsReorder
+		std::vector<double> gaps(scheduler.ThreadCount(), 0.0);
+		scheduler.ParallelForWorker(n, PARALLEL_GRAIN, [&](int begin, int end, int worker) {
+			double sum = 0.0;
+			for (int i = begin; i < end; ++i) {
+				for (int k = neighborOffsets[i]; k < neighborOffsets[i + 1]; ++k) {
+					sum += std::abs(neighborIndices[k] - i);
 				}
 			}
+			gaps[worker] += sum;
+		});
+		double total = 0.0;
+		for (double g : gaps) {
+			total += g;
+		}
+		neighborGap = total / std::max(1, neighborOffsets[n]);
+		if (sortedNeighborGap == 0.0) {
+			sortedNeighborGap = neighborGap;
 		}
 	}
+
+	if (usePairCache) {
+		pairW.resize(neighborIndices.size());
+		pairGradW.resize(neighborIndices.size());
+	}
 }
 
-void FluidSystem::ComputeDensity() {
-	for (int i = 0; i < fluidPs.size(); ++i) {
-		std::unique_ptr<Fluid>& p = fluidPs.at(i);
-		p->density = 0.0;
-		for (int j : neighbors.at(i)) { // for each neighbor
-			p->density += PolyKernel(glm::length(p->predictPos - fluidPs.at(j)->predictPos));
+
+// equiv. Finding the Neighbors
+// each chunk gathers into its own buffer and records counts, the buffers
+// are then stitched into the CSR arrays once the offsets are known
+template <typename Real, typename Grid>
+void FluidSystem::GatherNeighbors(const Grid& cells, double searchRadius) {
+	typedef typename FluidParticlesT<Real>::Vec3 Vec3;
+	const std::vector<Vec3>& predictPos = Particles(Real()).predictPos;
+	scheduler.ParallelFor((int)predictPos.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+		std::vector<int>& found = chunkNeighbors[begin / PARALLEL_GRAIN];
+		found.clear();
+		for (int i = begin; i < end; ++i) {
+			int count = (int)found.size();
+			const Vec3& p = predictPos[i];
+			glm::ivec3 gridPos = cellCoords[i];
+
+			// 2x2 neighborhood.
+			cells.ForEachNeighborCell(gridPos, [&](int gIndex) {
+				int start = cells.CellStart(gIndex);
+				int cellEnd = start + cells.CellCount(gIndex);
+				for (int k = start; k < cellEnd; ++k) { // each 
+					int pIndex = cells.Particle(k);
+					double lenR = glm::length(p - predictPos[pIndex]);
+					if (lenR <= searchRadius) {
+						found.push_back(pIndex);
+					}
+				}
+			});
+			neighborOffsets[i + 1] = (int)found.size() - count;
 		}
+	});
+}
+
+template <typename Real>
+PbfSimdArgs<Real> FluidSystem::SimdArgs() {
+	FluidParticlesT<Real>& ps = Particles(Real());
+	PbfSimdArgs<Real> args;
+	args.pos = reinterpret_cast<const Real*>(ps.predictPos.data());
+	args.offsets = neighborOffsets.data();
+	args.indices = neighborIndices.data();
+	args.radius = SPH_RADIUS;
+	args.polyCoef = pbfKernels.density.coef;
+	args.spikyCoef = pbfKernels.gradient.coef;
+	args.polyDen = pbfKernels.scorrDen;
+	args.restDensity = pbfKernels.restDensity;
+	args.relaxation = RELAXATION;
+	args.kCorr = kCorr;
+	args.density = ps.density.data();
+	args.lambda = ps.lambda.data();
+	args.deltaPos = reinterpret_cast<Real*>(ps.deltaPos.data());
+	return args;
+}
+
+// the scalar stages widen every position to double before subtracting, so float
+// storage only rounds what is stored, never the sums
+template <typename S>
+void FluidSystem::ComputeDensity() {
+	TraceSpan span("density", "solver");
+	typedef typename S::Real Real;
+	typedef typename FluidParticlesT<Real>::Vec3 Vec3;
+	FluidParticlesT<Real>& ps = Particles(Real());
+	if (const PbfSimdKernels<Real>* simd = ActiveSimdKernels<S>()) {
+		PbfSimdArgs<Real> args = SimdArgs<Real>();
+		scheduler.ParallelFor((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+			simd->density(args, begin, end);
+		});
+		return;
+	}
+	const typename S::Kernels& kernels = Kernels(typename S::Kernels());
+	const std::vector<Vec3>& predictPos = ps.predictPos;
+	if (PairTraversal()) {
+		// both kernels once per pair, lambda only has to combine the sums
+		double self = kernels.density.W(0.0);
+		scheduler.ParallelFor((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				pairDensity[i] = self;
+				pairGradNorm[i] = 0.0;
+				pairVector[i] = glm::dvec3(0.0);
+			}
+		});
+		ForEachPair([&](int i, int j) {
+			glm::dvec3 r = glm::dvec3(predictPos[i]) - glm::dvec3(predictPos[j]);
+			double r2 = glm::length2(r);
+			double w = kernels.density.W(r2);
+			glm::dvec3 grad = kernels.gradient.Grad(r, r2) / kernels.restDensity;
+			double grad2 = glm::length2(grad);
+			pairDensity[i] += w;
+			pairDensity[j] += w;
+			pairGradNorm[i] += grad2;
+			pairGradNorm[j] += grad2;
+			// grad W is odd in r
+			pairVector[i] += grad;
+			pairVector[j] -= grad;
+		});
+		scheduler.ParallelFor((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				ps.density[i] = (Real)pairDensity[i];
+			}
+		});
+		return;
 	}
+	scheduler.ParallelFor((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			glm::dvec3 p = glm::dvec3(predictPos[i]);
+			double density = 0.0;
+			for (int k = neighborOffsets[i]; k < neighborOffsets[i + 1]; ++k) { // for each neighbor
+				glm::dvec3 r = p - glm::dvec3(predictPos[neighborIndices[k]]);
+				double r2 = glm::length2(r);
+				if (usePairCache) {
+					// lambda and corrections reuse both kernels
+					pairW[k] = kernels.density.W(r2);
+					pairGradW[k] = kernels.gradient.Grad(r, r2);
+					density += pairW[k];
+				} else {
+					density += kernels.density.W(r2);
+				}
+			}
+			ps.density[i] = (Real)density;
+		}
+	});
 }
 
+template <typename S>
 void FluidSystem::ComputeLambda() {
-	for (int i = 0; i < fluidPs.size(); ++i) {
-		std::unique_ptr<Fluid>& p = fluidPs.at(i);
-		double sumGradients = 0.0;
-		glm::dvec3 pGrad = glm::dvec3(0.0);
-		for (int j : neighbors.at(i)) { // for each neighbor
-			std::unique_ptr<Fluid>& pcurr = fluidPs.at(j);
+	TraceSpan span("lambda", "solver");
+	typedef typename S::Real Real;
+	typedef typename FluidParticlesT<Real>::Vec3 Vec3;
+	FluidParticlesT<Real>& ps = Particles(Real());
+	const typename S::Kernels& kernels = Kernels(typename S::Kernels());
+	// compression sum and max per worker, only while something reads them
+	std::vector<DensityError> errors(densityTolerance > 0.0 || stageClock.isRunning() ? scheduler.ThreadCount() : 0);
+	if (const PbfSimdKernels<Real>* simd = ActiveSimdKernels<S>()) {
+		PbfSimdArgs<Real> args = SimdArgs<Real>();
+		scheduler.ParallelForWorker((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end, int worker) {
+			simd->lambda(args, begin, end);
+			if (!errors.empty()) {
+				// densities of the chunk are still in cache
+				for (int i = begin; i < end; ++i) {
+					errors[worker].add(ps.density[i] / kernels.restDensity - 1.0);
+				}
+			}
+		});
+		StoreDensityError(errors);
+		return;
+	}
+	const std::vector<Vec3>& predictPos = ps.predictPos;
+	scheduler.ParallelForWorker((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end, int worker) {
+		for (int i = begin; i < end; ++i) {
+			glm::dvec3 p = glm::dvec3(predictPos[i]);
+			double sumGradients = 0.0;
+			glm::dvec3 pGrad = glm::dvec3(0.0);
+			if (PairTraversal()) {
+				// scattered by ComputeDensity
+				sumGradients = pairGradNorm[i];
+				pGrad = pairVector[i];
+			} else {
+				for (int k = neighborOffsets[i]; k < neighborOffsets[i + 1]; ++k) { // for each neighbor
+					glm::dvec3 r;
+					if (usePairCache) {
+						r = pairGradW[k];
+					} else {
+						r = (p - glm::dvec3(predictPos[neighborIndices[k]]));
+						r = kernels.gradient.Grad(r, glm::length2(r));
+					}
+					r /= kernels.restDensity;
+					sumGradients += glm::length2(r);
+					pGrad += r; // -= r; ?? - i think += b/c -45
+				}
+			}
+			sumGradients += glm::length2(pGrad);
+			double constraint = ps.density[i] / kernels.restDensity - 1.0; // real scale constraint
+			ps.lambda[i] = (Real)(-constraint / (sumGradients + RELAXATION)); // maybe + 500 or so
+			if (!errors.empty()) {
+				errors[worker].add(constraint);
+			}
+		}
+	});
+	StoreDensityError(errors);
+}
 
-			// Spiky Kernel - modifies r by ref
-			glm::dvec3 r = (p->predictPos - pcurr->predictPos);
-			SpikyKernel(r);
-			r /= REST_DENSITY;
-			// End Spiky Kernel
-			sumGradients += glm::length2(r);
-			pGrad += r; // -= r; ?? - i think += b/c -45
+template <typename S>
+void FluidSystem::ComputeDensityLambda() {
+	TraceSpan span("density lambda", "solver");
+	typedef typename S::Real Real;
+	typedef typename FluidParticlesT<Real>::Vec3 Vec3;
+	FluidParticlesT<Real>& ps = Particles(Real());
+	const typename S::Kernels& kernels = Kernels(typename S::Kernels());
+	std::vector<DensityError> errors(densityTolerance > 0.0 || stageClock.isRunning() ? scheduler.ThreadCount() : 0);
+	if (const PbfSimdKernels<Real>* simd = ActiveSimdKernels<S>()) {
+		PbfSimdArgs<Real> args = SimdArgs<Real>();
+		scheduler.ParallelForWorker((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end, int worker) {
+			// lambda only reads the densities of its own chunk, the neighbors are still in cache
+			simd->density(args, begin, end);
+			simd->lambda(args, begin, end);
+			if (!errors.empty()) {
+				for (int i = begin; i < end; ++i) {
+					errors[worker].add(ps.density[i] / kernels.restDensity - 1.0);
+				}
+			}
+		});
+		StoreDensityError(errors);
+		return;
+	}
+	const std::vector<Vec3>& predictPos = ps.predictPos;
+	scheduler.ParallelForWorker((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end, int worker) {
+		for (int i = begin; i < end; ++i) {
+			glm::dvec3 p = glm::dvec3(predictPos[i]);
+			double density = 0.0;
+			double sumGradients = 0.0;
+			glm::dvec3 pGrad = glm::dvec3(0.0);
+			for (int k = neighborOffsets[i]; k < neighborOffsets[i + 1]; ++k) { // for each neighbor
+				glm::dvec3 r = p - glm::dvec3(predictPos[neighborIndices[k]]);
+				double r2 = glm::length2(r);
+				double w = kernels.density.W(r2);
+				glm::dvec3 grad = kernels.gradient.Grad(r, r2);
+				if (usePairCache) {
+					pairW[k] = w;
+					pairGradW[k] = grad;
+				}
+				// same order of operations as the two stages, so the results match bit for bit
+				density += w;
+				grad /= kernels.restDensity;
+				sumGradients += glm::length2(grad);
+				pGrad += grad;
+			}
+			sumGradients += glm::length2(pGrad);
+			ps.density[i] = (Real)density;
+			double constraint = ps.density[i] / kernels.restDensity - 1.0;
+			ps.lambda[i] = (Real)(-constraint / (sumGradients + RELAXATION));
+			if (!errors.empty()) {
+				errors[worker].add(constraint);
+			}
 		}
-		sumGradients += glm::length2(pGrad);
-		double constraint = p->density / REST_DENSITY - 1.0; // real scale constraint
-		p->lambda = -constraint / (sumGradients + RELAXATION); // maybe + 500 or so
+	});
+	StoreDensityError(errors);
+}
+
+void FluidSystem::StoreDensityError(const std::vector<DensityError>& errors) {
+	if (errors.empty()) {
+		return;
+	}
+	DensityError total;
+	for (const DensityError& e : errors) {
+		total.sum += e.sum;
+		total.max = std::max(total.max, e.max);
 	}
+	avgDensityError = NumPoints() > 0 ? total.sum / NumPoints() : 0.0;
+	maxDensityError = total.max;
 }
 
-void FluidSystem::ComputeCorrections() {
-	double polyDen = PolyKernel(0.2 * SPH_RADIUS);
-	for (int i = 0; i < fluidPs.size(); ++i) {
-		std::unique_ptr<Fluid>& p = fluidPs.at(i);
-		p->deltaPos = glm::dvec3(0.0);
-		for (int j : neighbors.at(i)) { // for each neighbor
-			std::unique_ptr<Fluid>& pcurr = fluidPs.at(j);
-			//---------Calculate SCORR-----
-			double frac = PolyKernel(glm::length(p->predictPos - pcurr->predictPos)) / polyDen;
-			double sCorr = -kCorr * frac * frac * frac * frac;
-			//------------End SCORR calculation-------
+// fused writes predictPos + correction into tmp and swaps the two once every particle
+// has read the old positions, that's ApplyCorrections without its own pass. on the last
+// iteration it also does the velocity update of Advance
+template <typename S>
+void FluidSystem::ComputeCorrections(bool fused, bool last) {
+	TraceSpan span(fused ? "corrections apply" : "corrections", "solver");
+	typedef typename S::Real Real;
+	typedef typename FluidParticlesT<Real>::Vec3 Vec3;
+	FluidParticlesT<Real>& ps = Particles(Real());
+	auto apply = [&](int i, const Vec3& delta) {
+		Vec3 p = ps.predictPos[i] + delta;
+		ps.tmp[i] = p;
+		if (warmStart) {
+			ps.warmPos[i] += delta;
+		}
+		if (last) {
+			ps.vel[i] = Vec3((glm::dvec3(p) - glm::dvec3(ps.pos[i])) / timeStep);
+			ps.pos[i] = p;
+		}
+	};
+	if (const PbfSimdKernels<Real>* simd = ActiveSimdKernels<S>()) {
+		PbfSimdArgs<Real> args = SimdArgs<Real>();
+		scheduler.ParallelFor((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+			(S::tensile ? simd->corrections : simd->plainCorrections)(args, begin, end);
+			if (fused) {
+				for (int i = begin; i < end; ++i) {
+					apply(i, ps.deltaPos[i]);
+				}
+			}
+		});
+		if (fused) {
+			ps.predictPos.swap(ps.tmp);
+		}
+		return;
+	}
+	const std::vector<Vec3>& predictPos = ps.predictPos;
+	const std::vector<Real>& lambda = ps.lambda;
+	const typename S::Kernels& kernels = Kernels(typename S::Kernels());
+	if (PairTraversal()) {
+		scheduler.ParallelFor((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+			std::fill(pairVector.begin() + begin, pairVector.begin() + end, glm::dvec3(0.0));
+		});
+		ForEachPair([&](int i, int j) {
+			glm::dvec3 r = glm::dvec3(predictPos[i]) - glm::dvec3(predictPos[j]);
+			double r2 = glm::length2(r);
+			double scale = (double)lambda[i] + (double)lambda[j];
+			if (S::tensile) {
+				double frac = kernels.density.W(r2) / kernels.scorrDen;
+				double sCorr = -kCorr * frac * frac * frac * frac;
+				scale += sCorr;
+			}
+			// lambda and the tensile term are symmetric, only the gradient flips for j
+			glm::dvec3 push = kernels.gradient.Grad(r, r2) / kernels.restDensity * scale;
+			pairVector[i] += push;
+			pairVector[j] -= push;
+		});
+		scheduler.ParallelFor((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				ps.deltaPos[i] = Vec3(pairVector[i]);
+			}
+		});
+		return;
+	}
+	scheduler.ParallelFor((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			glm::dvec3 p = glm::dvec3(predictPos[i]);
+			glm::dvec3 deltaPos = glm::dvec3(0.0);
+			for (int k = neighborOffsets[i]; k < neighborOffsets[i + 1]; ++k) { // for each neighbor
+				int j = neighborIndices[k];
+				double w = 0.0;
+				glm::dvec3 grad;
+				if (usePairCache) {
+					w = pairW[k];
+					grad = pairGradW[k];
+				} else {
+					glm::dvec3 r = p - glm::dvec3(predictPos[j]);
+					double r2 = glm::length2(r);
+					// W only feeds scorr
+					if (S::tensile) {
+						w = kernels.density.W(r2);
+					}
+					grad = kernels.gradient.Grad(r, r2);
+				}
+				double scale = (double)lambda[i] + (double)lambda[j];
+				if (S::tensile) {
+					//---------Calculate SCORR-----
+					double frac = w / kernels.scorrDen;
+					double sCorr = -kCorr * frac * frac * frac * frac;
+					//------------End SCORR calculation-------
+					scale += sCorr;
+				}
 
-			// Spiky Kernel - modifies r by ref
-			glm::dvec3 grad = (p->predictPos - pcurr->predictPos);
-			SpikyKernel(grad);
-			grad /= REST_DENSITY;
-			// End Spiky Kernel
+				grad /= kernels.restDensity;
 
-			//p->deltaPos += r * (p->lambda + pcurr->lambda
-			p->deltaPos += grad * (p->lambda + pcurr->lambda + sCorr);
+				deltaPos += grad * scale;
+			}
+			if (fused) {
+				apply(i, Vec3(deltaPos));
+			} else {
+				ps.deltaPos[i] = Vec3(deltaPos);
+			}
 		}
+	});
+	if (fused) {
+		ps.predictPos.swap(ps.tmp);
 	}
 }
 
+template <typename Real>
 void FluidSystem::ApplyCorrections() {
-	for (std::unique_ptr<Fluid>& p : fluidPs) {
-		p->predictPos += p->deltaPos;
+	TraceSpan span("apply", "solver");
+	FluidParticlesT<Real>& ps = Particles(Real());
+	scheduler.ParallelFor((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			ps.predictPos[i] += ps.deltaPos[i];
+		}
+		if (warmStart) {
+			for (int i = begin; i < end; ++i) {
+				ps.warmPos[i] += ps.deltaPos[i];
+			}
+		}
+	});
+}
+
+template <typename Grid>
+void FluidSystem::BuildColors(const Grid& cells) {
+	const int colors = 27;
+	std::vector<std::vector<int>> byColor(colors);
+	for (int c = 0; c < cells.NumCells(); ++c) {
+		if (cells.CellCount(c) > 0) {
+			// positive mod so cells left of the origin alternate too
+			glm::ivec3 m = ((cells.CellPos(c) % 3) + 3) % 3;
+			byColor[m.x + 3 * m.y + 9 * m.z].push_back(c);
+		}
+	}
+	colorParticles.clear();
+	colorCells.assign(1, 0);
+	colorStart.assign(1, 0);
+	for (const std::vector<int>& group : byColor) {
+		for (int c : group) {
+			for (int k = cells.CellStart(c); k < cells.CellStart(c) + cells.CellCount(c); ++k) {
+				colorParticles.push_back(cells.Particle(k));
+			}
+			colorCells.push_back((int)colorParticles.size());
+		}
+		colorStart.push_back((int)colorCells.size() - 1);
+	}
+	// the dense grid skips particles pushed outside the box, they may neighbor any color
+	int n = NumPoints();
+	if ((int)colorParticles.size() < n) {
+		std::vector<char> placed(n, 0);
+		for (int i : colorParticles) {
+			placed[i] = 1;
+		}
+		for (int i = 0; i < n; ++i) {
+			if (!placed[i]) {
+				colorParticles.push_back(i);
+			}
+		}
+		colorCells.push_back((int)colorParticles.size());
+		colorStart.push_back((int)colorCells.size() - 1);
+	}
+}
+
+void FluidSystem::BuildHalfLists() {
+	int n = NumPoints();
+	// the dense grid leaves particles outside the box out of every cell, nobody lists
+	// them back, so they own all of their pairs and run in the serial outside color
+	auto outside = [&](int i) {
+		return activeGrid == GridType::Dense && grid.FindCell(cellCoords[i]) < 0;
+	};
+	// the lower of the two cells in z, y, x order owns the pair, the lower index
+	// within one cell
+	auto owns = [&](int i, int j) {
+		const glm::ivec3& a = cellCoords[i];
+		const glm::ivec3& b = cellCoords[j];
+		if (a.z != b.z) {
+			return a.z < b.z;
+		}
+		if (a.y != b.y) {
+			return a.y < b.y;
+		}
+		if (a.x != b.x) {
+			return a.x < b.x;
+		}
+		return i < j;
+	};
+	halfOffsets.resize(n + 1);
+	scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int end) {
+		// the full lists are stitched already, so the chunk buffers are free again
+		std::vector<int>& found = chunkNeighbors[begin / PARALLEL_GRAIN];
+		found.clear();
+		for (int i = begin; i < end; ++i) {
+			int count = (int)found.size();
+			bool out = outside(i);
+			for (int k = neighborOffsets[i]; k < neighborOffsets[i + 1]; ++k) {
+				int j = neighborIndices[k];
+				if (out ? j != i : owns(i, j) && !outside(j)) {
+					found.push_back(j);
+				}
+			}
+			halfOffsets[i + 1] = (int)found.size() - count;
+		}
+	});
+	halfOffsets[0] = 0;
+	for (int i = 0; i < n; ++i) {
+		halfOffsets[i + 1] += halfOffsets[i];
+	}
+	halfIndices.resize(halfOffsets[n]);
+	scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int /*end*/) {
+		const std::vector<int>& found = chunkNeighbors[begin / PARALLEL_GRAIN];
+		std::copy(found.begin(), found.end(), halfIndices.begin() + halfOffsets[begin]);
+	});
+	pairDensity.resize(n);
+	pairGradNorm.resize(n);
+	pairVector.resize(n);
+}
+
+template <typename F>
+void FluidSystem::ForEachPair(F&& fn) {
+	for (int color = 0; color + 1 < (int)colorStart.size(); ++color) {
+		int first = colorStart[color];
+		scheduler.ParallelFor(colorStart[color + 1] - first, COLOR_GRAIN, [&](int begin, int end) {
+			for (int c = first + begin; c < first + end; ++c) {
+				for (int k = colorCells[c]; k < colorCells[c + 1]; ++k) {
+					int i = colorParticles[k];
+					for (int h = halfOffsets[i]; h < halfOffsets[i + 1]; ++h) {
+						fn(i, halfIndices[h]);
+					}
+				}
+			}
+		});
+	}
+}
+
+template <typename S>
+void FluidSystem::ProjectColored() {
+	TraceSpan span("colored sweep", "solver");
+	typedef typename S::Real Real;
+	typedef typename FluidParticlesT<Real>::Vec3 Vec3;
+	FluidParticlesT<Real>& ps = Particles(Real());
+	const typename S::Kernels& kernels = Kernels(typename S::Kernels());
+	std::vector<Vec3>& predictPos = ps.predictPos;
+	std::vector<DensityError> errors(densityTolerance > 0.0 || stageClock.isRunning() ? scheduler.ThreadCount() : 0);
+
+	for (int color = 0; color + 1 < (int)colorStart.size(); ++color) {
+		int first = colorStart[color];
+		// the outside color is a single cell, so it runs on one thread
+		scheduler.ParallelForWorker(colorStart[color + 1] - first, COLOR_GRAIN, [&](int begin, int end, int worker) {
+			std::vector<glm::dvec3> grads;
+			for (int c = first + begin; c < first + end; ++c) {
+				for (int k = colorCells[c]; k < colorCells[c + 1]; ++k) {
+					// project the density constraint of i alone: it moves i and every neighbor,
+					// so the next particle already sees the result
+					int i = colorParticles[k];
+					int from = neighborOffsets[i];
+					int count = neighborOffsets[i + 1] - from;
+					glm::dvec3 p = glm::dvec3(predictPos[i]);
+					grads.resize(count);
+					double density = 0.0;
+					double sumGradients = 0.0;
+					glm::dvec3 pGrad = glm::dvec3(0.0);
+					for (int n = 0; n < count; ++n) {
+						glm::dvec3 r = p - glm::dvec3(predictPos[neighborIndices[from + n]]);
+						double r2 = glm::length2(r);
+						density += kernels.density.W(r2);
+						grads[n] = kernels.gradient.Grad(r, r2) / kernels.restDensity;
+						sumGradients += glm::length2(grads[n]);
+						pGrad += grads[n];
+					}
+					sumGradients += glm::length2(pGrad);
+					double constraint = density / kernels.restDensity - 1.0;
+					double lambda = -constraint / (sumGradients + RELAXATION);
+					ps.density[i] = (Real)density;
+					ps.lambda[i] = (Real)lambda;
+					if (!errors.empty()) {
+						errors[worker].add(constraint);
+					}
+
+					glm::dvec3 deltaPos = glm::dvec3(0.0);
+					for (int n = 0; n < count; ++n) {
+						int j = neighborIndices[from + n];
+						double scale = lambda;
+						if (S::tensile) {
+							glm::dvec3 r = p - glm::dvec3(predictPos[j]);
+							double frac = kernels.density.W(glm::length2(r)) / kernels.scorrDen;
+							// the pair's tensile term is split with the constraint of j
+							double sCorr = -0.5 * kCorr * frac * frac * frac * frac;
+							scale += sCorr;
+						}
+						glm::dvec3 push = grads[n] * scale;
+						deltaPos += push;
+						if (j != i) {
+							predictPos[j] -= Vec3(push);
+							if (warmStart) {
+								ps.warmPos[j] -= Vec3(push);
+							}
+						}
+					}
+					predictPos[i] += Vec3(deltaPos);
+					if (warmStart) {
+						ps.warmPos[i] += Vec3(deltaPos);
+					}
+				}
+			}
+		});
 	}
+	StoreDensityError(errors);
 }
 
-void FluidSystem::Advance() {
+template <typename Real>
+void FluidSystem::WarmStart() {
+	TraceSpan span("warm start", "solver");
+	typedef typename FluidParticlesT<Real>::Vec3 Vec3;
+	FluidParticlesT<Real>& ps = Particles(Real());
+	scheduler.ParallelFor((int)ps.size(), PARALLEL_GRAIN, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			int count = neighborOffsets[i + 1] - neighborOffsets[i];
+			int previous = ps.warmNeighbors[i];
+			// splashing or freshly settled particles would replay a push meant for another neighborhood
+			bool settled = previous > 0 && std::abs(count - previous) <= WARM_START_TOPOLOGY * previous;
+			Vec3 replay = settled ? Vec3(glm::dvec3(ps.warmPos[i]) * warmDamping) : Vec3(0);
+			ps.predictPos[i] += replay;
+			// this step's corrections add on top of what was replayed
+			ps.warmPos[i] = replay;
+			ps.warmNeighbors[i] = count;
+		}
+	});
+}
+
+template <typename S>
+void FluidSystem::Advance(bool velocityDone) {
+	TraceSpan span("advance", "solver");
+	typedef typename S::Real Real;
+	typedef typename FluidParticlesT<Real>::Vec3 Vec3;
+	FluidParticlesT<Real>& ps = Particles(Real());
+	const typename S::Kernels& kernels = Kernels(typename S::Kernels());
+	const std::vector<Vec3>& predictPos = ps.predictPos;
+	std::vector<Vec3>& vel = ps.vel;
+	std::vector<Vec3>& tmp = ps.tmp;
+	int n = (int)ps.size();
+
 	//update all velocities
-	for (int i = 0; i < fluidPs.size(); ++i) {
-		std::unique_ptr<Fluid>& p = fluidPs.at(i);
-		//std::cout << "for particle: " << i << std::endl;
-		//std::cout << "p pos: " << glm::to_string(p->pos) << std::endl;
-		//std::cout << "p pred: " << glm::to_string(p->predictPos) << std::endl;
-		//std::cout << "p delP: " << glm::to_string(p->deltaPos) << std::endl;
-		//std::cout << "p vel: " << glm::to_string(p->vel) << std::endl;
-		//std::cout << "p dens: " << p->density << std::endl;
-		//std::cout << "p lamb: " << p->lambda << std::endl << std::endl;
-		p->vel = (p->predictPos - p->pos) / m_DT;
+	if (!velocityDone) {
+		scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				vel[i] = Vec3((glm::dvec3(predictPos[i]) - glm::dvec3(ps.pos[i])) / timeStep);
 
-		// vorticity confinement here?
-		p->pos = p->predictPos;
+				// vorticity confinement here?
+				ps.pos[i] = predictPos[i];
+			}
+		});
 	}
+	stageClock.lap(stats.velocity);
 
 	// VORTICITY CONFINEMENT
-	for (int i = 0; i < fluidPs.size(); ++i) {
-		std::unique_ptr<Fluid>& p = fluidPs.at(i);
+	if (S::vorticity) {
+		// forces go through tmp so every particle sees the same pre-confinement velocities
+		scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				glm::dvec3 p = glm::dvec3(predictPos[i]);
+				glm::dvec3 vi = glm::dvec3(vel[i]);
 
-		glm::dvec3 omega = glm::dvec3(0.0f);
-		glm::dvec3 eta = glm::dvec3(0.0f);
-		for (int j : neighbors.at(i)) {
-			std::unique_ptr<Fluid>& pcurr = fluidPs.at(j);
-			glm::dvec3 grad = (p->predictPos - pcurr->predictPos);
-			SpikyKernel(grad);
+				glm::dvec3 omega = glm::dvec3(0.0f);
+				glm::dvec3 eta = glm::dvec3(0.0f);
+				for (int k = neighborOffsets[i]; k < neighborOffsets[i + 1]; ++k) {
+					int j = neighborIndices[k];
+					glm::dvec3 r = p - glm::dvec3(predictPos[j]);
+					glm::dvec3 grad = kernels.gradient.Grad(r, glm::length2(r));
 
-			eta += grad;
-			omega += glm::cross((pcurr->vel - p->vel), grad); // eqn 15 in pbf
-		}
-		eta *= glm::length(omega);
+					eta += grad;
+					omega += glm::cross((glm::dvec3(vel[j]) - vi), grad); // eqn 15 in pbf
+				}
+				eta *= glm::length(omega);
 
-		glm::dvec3 vortForce = glm::cross(glm::normalize(eta), omega) * vortConst; // eqn 16
-		p->vel += vortForce * m_DT;
+				// no curl (or a perfectly symmetric neighborhood) means no confinement,
+				// normalizing a zero eta would turn the velocity into NaN
+				if (glm::length2(eta) > 0.0) {
+					tmp[i] = Vec3(glm::cross(glm::normalize(eta), omega) * vortConst); // eqn 16
+				} else {
+					tmp[i] = Vec3(0);
+				}
+			}
+		});
+		scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				vel[i] = Vec3(glm::dvec3(vel[i]) + glm::dvec3(tmp[i]) * timeStep);
+			}
+		});
 	}
+	stageClock.lap(stats.vorticity);
 	// END VORTICITY CONFINEMENT
 
 	// VISCOSITY
-	for (int i = 0; i < fluidPs.size(); ++i) {
-		std::unique_ptr<Fluid>& p = fluidPs.at(i);
-		glm::dvec3 acc(0.0, 0.0, 0.0);
-		for (int j : neighbors.at(i)) {
-			std::unique_ptr<Fluid>& pcurr = fluidPs.at(j);
-			acc += (pcurr->vel - p->vel) * PolyKernel(glm::length(p->predictPos - pcurr->predictPos));
+	if (S::viscosity) {
+		if (PairTraversal()) {
+			scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int end) {
+				std::fill(pairVector.begin() + begin, pairVector.begin() + end, glm::dvec3(0.0));
+			});
+			ForEachPair([&](int i, int j) {
+				double w = kernels.density.W(glm::length2(glm::dvec3(predictPos[i]) - glm::dvec3(predictPos[j])));
+				glm::dvec3 acc = (glm::dvec3(vel[j]) - glm::dvec3(vel[i])) * w;
+				pairVector[i] += acc;
+				pairVector[j] -= acc;
+			});
+			scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int end) {
+				for (int i = begin; i < end; ++i) {
+					tmp[i] = Vec3(pairVector[i]);
+				}
+			});
+		} else {
+			scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int end) {
+				for (int i = begin; i < end; ++i) {
+					glm::dvec3 p = glm::dvec3(predictPos[i]);
+					glm::dvec3 vi = glm::dvec3(vel[i]);
+					glm::dvec3 acc(0.0, 0.0, 0.0);
+					for (int k = neighborOffsets[i]; k < neighborOffsets[i + 1]; ++k) {
+						int j = neighborIndices[k];
+						acc += (glm::dvec3(vel[j]) - vi) * kernels.density.W(glm::length2(p - glm::dvec3(predictPos[j])));
+					}
+					tmp[i] = Vec3(acc);
+				}
+			});
 		}
-		p->tmp = acc;
-	}
 
-	for (std::unique_ptr<Fluid>& p : fluidPs) {
-		p->vel += viscConst * p->tmp * m_DT;
+		scheduler.ParallelFor(n, PARALLEL_GRAIN, [&](int begin, int end) {
+			for (int i = begin; i < end; ++i) {
+				vel[i] = Vec3(glm::dvec3(vel[i]) + viscConst * glm::dvec3(tmp[i]) * timeStep);
+			}
+		});
 	}
+	stageClock.lap(stats.viscosity);
 	// END VISCOSITY
-}
\ No newline at end of file
+}
@@ -23,18 +23,72 @@
 #ifndef DEF_FLUID_SYS
 	#define DEF_FLUID_SYS
 
+	#include <string>
 	#include <vector>
+	#include <type_traits>
 	#include "fluid.h"
+	#include "fluid_grid.h"
+	#include "fluid_threads.h"
+	#include "fluid_simd.h"
+	#include "fluid_kernels.h"
+	#include "fluid_stats.h"
 	#include <iostream>
 	
 	// Physical constants
 	#define GRAVITY_ON 1
 
 	// Tunable(ish) parameters
+	// default seconds per Run, a single fixed step unless adaptive stepping is on
 	#define m_DT 0.0083
+	// default clamp on adaptive substeps, seconds
+	#define MIN_TIME_STEP 0.0001
+	#define MAX_TIME_STEP (1.0 / 60.0)
+	// default iteration bounds once a density tolerance is set
+	#define MIN_CONSTRAINT_ITERATIONS 1
+	#define MAX_CONSTRAINT_ITERATIONS 8
+	// share of last step's correction a warm start replays, and how far (relative)
+	// a particle's neighbor count may move before its warm start is dropped
+	#define WARM_START_DAMPING 0.8
+	#define WARM_START_TOPOLOGY 0.25
 	#define REST_DENSITY 6378.0
 	#define MAX_NEIGHBOR 50
 	#define RELAXATION 600.0
+	// particles per parallel-for chunk
+	#define PARALLEL_GRAIN 512
+	// GridType::Auto stays dense while the box has at most this many cells per particle
+	#define MAX_DENSE_CELLS_PER_PARTICLE 8
+	// steps between morton reorders, and how much the mean neighbor index gap may
+	// grow over its post-sort value before an early reorder
+	#define REORDER_INTERVAL 100
+	#define REORDER_DEGRADATION 2.0
+	// cells per parallel-for chunk of a gauss-seidel color
+	#define COLOR_GRAIN 32
+
+	// how a constraint iteration moves particles: jacobi corrects everyone from the same
+	// positions, gauss-seidel sweeps 27 colors of cells so every cell sees the corrections
+	// of the colors before it. cells of one color are 3 apart and never share neighbors
+	enum class SolveMode {
+		Jacobi,
+		GaussSeidel
+	};
+
+	// storage for the particle arrays, Float keeps every sum and kernel in double
+	enum class Precision {
+		Double,
+		Float
+	};
+
+	// what a solver step is compiled for: particle storage type, kernel pair and which
+	// of the optional pbf terms it runs. a term whose coefficient is 0 is compiled out
+	// along with its neighbor loops
+	template <typename R, typename K, bool Vorticity = true, bool Viscosity = true, bool Tensile = true>
+	struct SolverTraits {
+		typedef R Real;
+		typedef K Kernels;
+		static const bool vorticity = Vorticity;
+		static const bool viscosity = Viscosity;
+		static const bool tensile = Tensile;
+	};
 
 	// Vector params
 	//#define SPH_VOLMIN glm::dvec3(-10, -10, 0)
@@ -54,6 +108,97 @@
 		void SPH_CreateExample(std::vector<glm::dvec3> p);
 		void setParameters(int ite, double visc, double vor, double tensile);
 		void cleanUp();
+		// 0 = one thread per core
+		void setThreadCount(int threads);
+		int getThreadCount() const { return scheduler.ThreadCount(); }
+		// build the cell list with the threaded counting sort / prefix sum
+		void setParallelGridBuild(bool parallel);
+		// cache W and grad W per neighbor pair once per constraint iteration
+		void setPairCache(bool enable);
+		// evaluate every neighbor pair once, from the particle that owns it, and add its
+		// kernels to both ends. halves the kernel evaluations of density, lambda,
+		// corrections and viscosity, not the neighbor search: the owned pairs are filtered
+		// out of the full lists. jacobi only, overrides the pair cache
+		void setPairTraversal(bool enable);
+		bool getPairTraversal() const { return pairTraversal; }
+		// jacobi iterations in two sweeps instead of four: lambda is computed with the
+		// density, corrected positions go to a second buffer instead of an apply pass and
+		// the last one updates the velocities too. same results, on by default, off runs
+		// every stage on its own for timing and debugging. the pair traversal runs staged
+		void setFusedIterations(bool enable);
+		bool getFusedIterations() const { return fuseIterations; }
+		// verlet lists: gather within SPH_RADIUS * (1 + skin) and only rebuild once a
+		// particle has moved more than half the skin. 0 rebuilds every step
+		void setVerletSkin(double skin);
+		// dense box grid, sparse hash of occupied cells, or pick by domain size
+		void setGridType(GridType type);
+		// false lets particles leave SPH_VOLMIN/SPH_VOLMAX, the grid is then always hashed
+		void setBoundary(bool enabled);
+		// sort particle storage along a z-order curve every few steps so neighbors
+		// sit close in memory. 0 never reorders, GetPos is unaffected either way
+		void setReorderInterval(int steps);
+		// vector width for density / lambda / corrections, capped at what the cpu
+		// supports. Scalar is the reference path, the pair cache and pair traversal run scalar
+		void setSimdLevel(SimdLevel level);
+		SimdLevel getSimdLevel() const { return simdLevel; }
+		// float storage halves the bandwidth of every stage, switching converts in place
+		void setPrecision(Precision p);
+		Precision getPrecision() const { return precision; }
+		// classic poly6 density with spiky gradients, or the cheaper wendland c2
+		void setKernel(KernelType type);
+		KernelType getKernel() const { return kernelType; }
+		// gauss-seidel runs the scalar kernels, the pair cache and simd stay jacobi only
+		void setSolveMode(SolveMode mode);
+		SolveMode getSolveMode() const { return solveMode; }
+
+		// tolerance > 0 ends the constraint loop once the mean compression
+		// max(density / REST_DENSITY - 1, 0) is below it, running between minIterations
+		// and maxIterations. 0 runs the fixed count from setParameters
+		void setConvergence(double tolerance, int minIterations = MIN_CONSTRAINT_ITERATIONS,
+			int maxIterations = MAX_CONSTRAINT_ITERATIONS);
+		double getTolerance() const { return densityTolerance; }
+		// iterations the last step ran and its compression going into the last one
+		int getIterationsUsed() const { return lastIterations; }
+		double getDensityError() const { return avgDensityError; }
+		double getMaxDensityError() const { return maxDensityError; }
+
+		// replay damping * last step's total constraint correction before the first
+		// iteration, so resting fluid starts most of the way to incompressible.
+		// particles whose neighborhood changed a lot start cold
+		void setWarmStart(bool enable, double damping = WARM_START_DAMPING);
+		bool getWarmStart() const { return warmStart; }
+
+		// seconds of simulation each Run advances
+		void setFrameTime(double seconds);
+		double getFrameTime() const { return frameTime; }
+		// cfl > 0 splits every Run into substeps that move the fastest particle at most
+		// cfl * SPH_RADIUS, clamped to [minStep, maxStep]. 0 runs one step of the frame time
+		void setAdaptiveStep(double cfl, double minStep = MIN_TIME_STEP, double maxStep = MAX_TIME_STEP);
+		double getCfl() const { return cflNumber; }
+		// substeps the last Run took and the length of its last one
+		int getSubsteps() const { return lastSubsteps; }
+		double getTimeStep() const { return timeStep; }
+
+		// stage timings and counters of every Run into getStats, off by default.
+		// costs a clock read per stage, nothing at all when built with FLUID_STATS 0
+		void setCollectStats(bool enable);
+		bool getCollectStats() const { return collectStats; }
+		const SolverStats& getStats() const { return stats; }
+		void resetStats() { stats = SolverStats(); }
+
+		// Runs (frames, not substeps) since SPH_CreateExample
+		int getStepCount() const { return stepCount; }
+		// complete solver state: parameters, domain, step counter and the particles at
+		// storage precision, so a restored system carries on exactly where it was saved.
+		// a failed load leaves the system empty
+		bool SaveCheckpoint(const std::string& path) const;
+		bool LoadCheckpoint(const std::string& path);
+
+		// thin accessors for the SOP, positions are in solver (radius scaled) space
+		int NumPoints() const { return (int)slotOf.size(); }
+		glm::dvec3 GetPos(int i) const {
+			return precision == Precision::Float ? glm::dvec3(fluidPsF.pos[slotOf[i]]) : fluidPs.pos[slotOf[i]];
+		}
 	private:
 		glm::dvec3 scaledMin;
 		glm::dvec3 scaledMax;
@@ -62,31 +207,206 @@
 		glm::ivec3 gridSpaceDiag;
 
 		int totalGridCells;
+		// cell edge, SPH_RADIUS plus the verlet skin
+		double cellSize;
+		glm::dvec3 gridOrigin;
+
+		void SetupGrid();
+		// sizes every per particle buffer for n points in input order
+		void Allocate(size_t n);
+		bool NeedsReorder();
+
+		// stages are instantiated per SolverTraits (or just the storage type when
+		// they never evaluate a kernel), Run picks the instantiation once per step
+		template <typename Real>
+		void Dispatch();
+		// Step instantiated for the terms setParameters left on
+		template <typename Real, typename K>
+		void StepTerms();
+		template <typename S>
+		void Step();
+		template <typename Real>
+		bool NeedsNeighborRebuild();
+		// length of the next substep with remaining seconds left in the frame
+		template <typename Real>
+		double NextTimeStep(double remaining);
+		template <typename Real>
+		void ReorderParticles();
 
+		template <typename Real>
 		void PredictPositions();
+		template <typename Real>
 		void FindNeighbors();
+		template <typename S>
 		void ComputeDensity();
+		template <typename S>
 		void ComputeLambda();
-		void ComputeCorrections();
+		template <typename S>
+		void ComputeCorrections(bool fused = false, bool last = false);
+		// ComputeDensity and ComputeLambda in one neighbor sweep
+		template <typename S>
+		void ComputeDensityLambda();
+		template <typename Real>
 		void ApplyCorrections();
-		void Advance();
+		template <typename Real>
+		void WarmStart();
+		// one gauss-seidel iteration over the colored cells
+		template <typename S>
+		void ProjectColored();
+		// groups the cells of the latest neighbor build by color
+		template <typename Grid>
+		void BuildColors(const Grid& cells);
+		// copies the pairs of the full lists that i owns into the half lists, needs the colors
+		void BuildHalfLists();
+		bool PairTraversal() const { return pairTraversal && solveMode == SolveMode::Jacobi; }
+		// fn(i, j) once per owned pair. the colors run one after another and a pair never
+		// reaches past the 3x3x3 block of its owner, so no two threads write one particle
+		template <typename F>
+		void ForEachPair(F&& fn);
+		// velocityDone when the last fused iteration already moved pos and vel
+		template <typename S>
+		void Advance(bool velocityDone);
 
-		double PolyKernel(double dist);
-		void SpikyKernel(glm::dvec3 &r);
+		// compression max(C, 0) of a range of particles, C = density / rest - 1. stretched
+		// particles at the surface don't count, they never reach rest density
+		struct DensityError {
+			double sum = 0.0;
+			double max = 0.0;
+			void add(double constraint) {
+				if (constraint > 0.0) {
+					sum += constraint;
+					max = constraint > max ? constraint : max;
+				}
+			}
+		};
+		void StoreDensityError(const std::vector<DensityError>& errors);
+
+		void RecordIteration(int iteration, const IterationTimes& times) {
+		#if FLUID_STATS
+			if (stageClock.isRunning()) {
+				if ((int)stats.iterations.size() <= iteration) {
+					stats.iterations.resize(iteration + 1);
+				}
+				stats.iterations[iteration] += times;
+			}
+		#endif
+		}
+
+		// kernel coefficients for the current SPH_RADIUS
+		void SetupKernels();
+		const PbfKernels& Kernels(const PbfKernels&) const { return pbfKernels; }
+		const WendlandKernels& Kernels(const WendlandKernels&) const { return wendlandKernels; }
+
+		template <typename Real>
+		PbfSimdArgs<Real> SimdArgs();
+		// the vector kernels implement poly6 / spiky only
+		template <typename S>
+		const PbfSimdKernels<typename S::Real>* ActiveSimdKernels() const {
+			if (usePairCache || PairTraversal() || !simdKernels || !std::is_same<typename S::Kernels, PbfKernels>::value) {
+				return nullptr;
+			}
+			return &simdKernels->For(typename S::Real());
+		}
 
 		glm::ivec3 GetGridPos(const glm::dvec3 &pos);
-		// get index in grid space
-		int GetGridIndex(const glm::ivec3 &gridPos);
-	public:
-		std::vector<std::unique_ptr<Fluid>> fluidPs;
-	private:
-		// grid maps indexSpace To vector of fluid there
-		std::vector<std::vector<int>> grid;
-		std::vector<std::vector<int>> neighbors;
+		template <typename Real, typename Grid>
+		void GatherNeighbors(const Grid& cells, double searchRadius);
+
+		// only the store matching precision is populated
+		FluidParticlesT<double> fluidPs;
+		FluidParticlesT<float> fluidPsF;
+		FluidParticlesT<double>& Particles(double) { return fluidPs; }
+		FluidParticlesT<float>& Particles(float) { return fluidPsF; }
+
+		// grid maps indexSpace To the range of fluid there
+		CellList grid;
+		HashedCellList hashedGrid;
+		GridType activeGrid;
+		std::vector<glm::ivec3> cellCoords;
+		// neighbors of i are neighborIndices[neighborOffsets[i] .. neighborOffsets[i + 1])
+		std::vector<int> neighborOffsets;
+		std::vector<int> neighborIndices;
+		// per chunk scratch so the neighbor search can run without locks
+		std::vector<std::vector<int>> chunkNeighbors;
+		// gauss-seidel order: the cells of color c are colorStart[c] .. colorStart[c + 1],
+		// cell k holds colorParticles[colorCells[k] .. colorCells[k + 1]). a last color
+		// holds particles outside the grid and runs as one serial cell
+		std::vector<int> colorParticles;
+		std::vector<int> colorCells;
+		std::vector<int> colorStart;
+		// pairs owned by i are halfIndices[halfOffsets[i] .. halfOffsets[i + 1])
+		std::vector<int> halfOffsets;
+		std::vector<int> halfIndices;
+		// what the pair traversal scatters into: density and sum |grad C|^2 per particle,
+		// then pairVector holds the gradient sum for lambda, the corrections or viscosity
+		std::vector<double> pairDensity;
+		std::vector<double> pairGradNorm;
+		std::vector<glm::dvec3> pairVector;
+		// input point id of each storage slot, and the slot holding each input point
+		std::vector<int> particleId;
+		std::vector<int> slotOf;
+		int stepsSinceReorder;
+		int stepCount;
+		// mean |i - j| over neighbor pairs, now and right after the last reorder
+		double neighborGap;
+		double sortedNeighborGap;
+
+		// predicted positions when the lists were last built
+		std::vector<glm::dvec3> buildPos;
+		bool neighborsDirty;
+
+		// per pair side buffers parallel to neighborIndices, filled by ComputeDensity
+		std::vector<double> pairW;
+		std::vector<glm::dvec3> pairGradW;
 
 		int myIteration;
+		double densityTolerance;
+		int minIterations;
+		int maxIterations;
+		int lastIterations;
+		bool warmStart;
+		double warmDamping;
+		// measured by ComputeLambda while a tolerance is set or stats are on
+		double avgDensityError;
+		double maxDensityError;
 		double viscConst;
 		double vortConst;
 		double kCorr;
+		// bit per nonzero coefficient, picks the SolverTraits of every step
+		enum {
+			VorticityTerm = 1,
+			ViscosityTerm = 2,
+			TensileTerm = 4
+		};
+		int activeTerms;
+
+		double frameTime;
+		double timeStep;
+		double cflNumber;
+		double minTimeStep;
+		double maxTimeStep;
+		int lastSubsteps;
+
+		KernelType kernelType;
+		SolveMode solveMode;
+		PbfKernels pbfKernels;
+		WendlandKernels wendlandKernels;
+
+		bool parallelGridBuild;
+		bool usePairCache;
+		bool pairTraversal;
+		bool fuseIterations;
+		double verletSkin;
+		GridType gridType;
+		bool useBoundary;
+		int reorderInterval;
+		SimdLevel simdLevel;
+		const PbfSimdKernelSet* simdKernels;
+		Precision precision;
+		bool collectStats;
+		SolverStats stats;
+		StageClock stageClock;
+
+		TaskScheduler scheduler;
 	};
 #endif
@@ -0,0 +1,136 @@
+#include <algorithm>
+
+#include "fluid_threads.h"
+#include "fluid_trace.h"
+
+TaskScheduler::TaskScheduler(int threads) :
+	numThreads(1),
+	queued(0),
+	pending(0),
+	stopping(false)
+{
+	SetThreadCount(threads);
+}
+
+TaskScheduler::~TaskScheduler() {
+	Stop();
+}
+
+void TaskScheduler::SetThreadCount(int count) {
+	if (count <= 0) {
+		count = std::max(1, (int)std::thread::hardware_concurrency());
+	}
+	if (count == numThreads && (int)queues.size() == count) {
+		return;
+	}
+	Stop();
+	numThreads = count;
+	Start();
+}
+
+void TaskScheduler::Start() {
+	stopping = false;
+	queues.clear();
+	for (int i = 0; i < numThreads; ++i) {
+		queues.push_back(std::make_unique<Queue>());
+	}
+	// queue 0 belongs to the calling thread
+	for (int i = 1; i < numThreads; ++i) {
+		threads.emplace_back(&TaskScheduler::WorkerLoop, this, i);
+	}
+}
+
+void TaskScheduler::Stop() {
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& t : threads) {
+		t.join();
+	}
+	threads.clear();
+}
+
+bool TaskScheduler::PopOrSteal(int worker, Task& task) {
+	{
+		Queue& own = *queues[worker];
+		std::lock_guard<std::mutex> guard(own.lock);
+		if (!own.tasks.empty()) {
+			task = own.tasks.back();
+			own.tasks.pop_back();
+			--queued;
+			return true;
+		}
+	}
+	for (int i = 1; i < numThreads; ++i) {
+		Queue& victim = *queues[(worker + i) % numThreads];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.tasks.empty()) {
+			task = victim.tasks.front();
+			victim.tasks.pop_front();
+			--queued;
+			return true;
+		}
+	}
+	return false;
+}
+
+void TaskScheduler::Execute(const Task& task, int worker) {
+	// one span per chunk shows how evenly a loop spread over the workers
+	TraceSpan span("chunk", "worker");
+	(*task.fn)(task.begin, task.end, worker);
+	--pending;
+}
+
+void TaskScheduler::WorkerLoop(int worker) {
+	Trace::NameThread("worker " + std::to_string(worker));
+	for (;;) {
+		Task task;
+		if (PopOrSteal(worker, task)) {
+			Execute(task, worker);
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(sleepLock);
+		wake.wait(guard, [this] { return stopping || queued > 0; });
+		if (stopping) {
+			return;
+		}
+	}
+}
+
+void TaskScheduler::ParallelForWorker(int n, int grain, const std::function<void(int, int, int)>& fn) {
+	if (n <= 0) {
+		return;
+	}
+	grain = std::max(1, grain);
+	if (numThreads == 1 || n <= grain) {
+		fn(0, n, 0);
+		return;
+	}
+
+	// deal the chunks out round robin, stealing evens out whatever is left over
+	int chunks = (n + grain - 1) / grain;
+	pending += chunks;
+	for (int c = 0; c < chunks; ++c) {
+		Task task = { &fn, c * grain, std::min(n, (c + 1) * grain) };
+		Queue& q = *queues[c % numThreads];
+		std::lock_guard<std::mutex> guard(q.lock);
+		q.tasks.push_back(task);
+		++queued;
+	}
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+	}
+	wake.notify_all();
+
+	// the caller works as worker 0 until every chunk has finished
+	while (pending > 0) {
+		Task task;
+		if (PopOrSteal(0, task)) {
+			Execute(task, 0);
+		} else {
+			std::this_thread::yield();
+		}
+	}
+}
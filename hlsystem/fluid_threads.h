@@ -0,0 +1,60 @@
+#ifndef DEF_FLUID_THREADS
+	#define DEF_FLUID_THREADS
+
+	#include <atomic>
+	#include <condition_variable>
+	#include <deque>
+	#include <functional>
+	#include <memory>
+	#include <mutex>
+	#include <thread>
+	#include <vector>
+
+	// small work-stealing pool for the solver's particle loops.
+	// each worker owns a deque, pops its own work from the back and steals
+	// from the front of the others; the calling thread works too.
+	class TaskScheduler {
+	public:
+		// 0 threads = one per hardware thread
+		explicit TaskScheduler(int threads = 0);
+		~TaskScheduler();
+
+		void SetThreadCount(int threads);
+		int ThreadCount() const { return numThreads; }
+
+		// fn(begin, end) over [0, n) in chunks of at most grain items
+		template <typename F>
+		void ParallelFor(int n, int grain, F&& fn) {
+			ParallelForWorker(n, grain, [&fn](int begin, int end, int) { fn(begin, end); });
+		}
+		// fn(begin, end, worker) with worker in [0, ThreadCount()), for per-thread scratch
+		void ParallelForWorker(int n, int grain, const std::function<void(int, int, int)>& fn);
+
+	private:
+		struct Task {
+			const std::function<void(int, int, int)>* fn;
+			int begin;
+			int end;
+		};
+		struct Queue {
+			std::mutex lock;
+			std::deque<Task> tasks;
+		};
+
+		void Start();
+		void Stop();
+		void WorkerLoop(int worker);
+		bool PopOrSteal(int worker, Task& task);
+		void Execute(const Task& task, int worker);
+
+		int numThreads;
+		std::vector<std::thread> threads;
+		std::vector<std::unique_ptr<Queue>> queues;
+
+		std::mutex sleepLock;
+		std::condition_variable wake;
+		std::atomic<int> queued;
+		std::atomic<int> pending;
+		bool stopping;
+	};
+#endif
@@ -0,0 +1,178 @@
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+#include "fluid_trace.h"
+
+std::atomic<bool> Trace::enabled(false);
+std::atomic<int> Trace::frame_(-1);
+
+namespace {
+	// flushed to the file once this much json is pending
+	const size_t TRACE_BUFFER = 1 << 20;
+
+	struct TraceFile {
+		std::mutex lock;
+		FILE* file = nullptr;
+		std::string path;
+		std::string buffer;
+		Trace::Clock::time_point origin;
+		bool first = true;
+		// bumped on every open so threads name themselves again in the new file
+		int generation = 0;
+
+		void Flush() {
+			if (file && !buffer.empty()) {
+				fwrite(buffer.data(), 1, buffer.size(), file);
+				fflush(file);
+			}
+			buffer.clear();
+		}
+		void Append(const char* event) {
+			buffer += first ? "[\n" : ",\n";
+			buffer += event;
+			first = false;
+			if (buffer.size() >= TRACE_BUFFER) {
+				Flush();
+			}
+		}
+		void CloseFile() {
+			if (file) {
+				buffer += first ? "[\n]\n" : "\n]\n";
+				Flush();
+				fclose(file);
+				file = nullptr;
+			}
+		}
+		~TraceFile() {
+			CloseFile();
+		}
+	};
+
+	TraceFile& File() {
+		static TraceFile traceFile;
+		return traceFile;
+	}
+
+	struct ThreadInfo {
+		int id;
+		int generation = -1;
+		std::string name;
+	};
+
+	ThreadInfo& CurrentThread() {
+		static std::atomic<int> nextId(1);
+		thread_local ThreadInfo info = { nextId++, -1, std::string() };
+		return info;
+	}
+
+	// json string contents, names here are plain ascii but paths and labels may not be
+	std::string Escape(const std::string& s) {
+		std::string out;
+		for (char c : s) {
+			if (c == '"' || c == '\\') {
+				out += '\\';
+				out += c;
+			} else if ((unsigned char)c < 0x20) {
+				char hex[8];
+				snprintf(hex, sizeof(hex), "\\u%04x", c);
+				out += hex;
+			} else {
+				out += c;
+			}
+		}
+		return out;
+	}
+
+	// the thread_name metadata event, once per thread and file. lock must be held
+	void DeclareThread(TraceFile& f, ThreadInfo& thread) {
+		if (thread.generation == f.generation) {
+			return;
+		}
+		thread.generation = f.generation;
+		std::string name = thread.name.empty() ? "thread " + std::to_string(thread.id) : thread.name;
+		std::string event = "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + std::to_string(thread.id) +
+			",\"args\":{\"name\":\"" + Escape(name) + "\"}}";
+		f.Append(event.c_str());
+	}
+
+	bool OpenFromEnvironment() {
+		const char* path = getenv("H2O_TRACE");
+		return path && *path && Trace::Open(path);
+	}
+	const bool openedFromEnvironment = OpenFromEnvironment();
+}
+
+bool Trace::Open(const std::string& path) {
+	TraceFile& f = File();
+	std::lock_guard<std::mutex> guard(f.lock);
+	enabled = false;
+	f.CloseFile();
+	f.file = fopen(path.c_str(), "wb");
+	if (!f.file) {
+		f.path.clear();
+		return false;
+	}
+	f.path = path;
+	f.buffer.clear();
+	f.first = true;
+	f.origin = Clock::now();
+	++f.generation;
+	enabled = true;
+	return true;
+}
+
+void Trace::Close() {
+	TraceFile& f = File();
+	std::lock_guard<std::mutex> guard(f.lock);
+	enabled = false;
+	f.CloseFile();
+	f.path.clear();
+}
+
+std::string Trace::Path() {
+	TraceFile& f = File();
+	std::lock_guard<std::mutex> guard(f.lock);
+	return f.path;
+}
+
+void Trace::NameThread(const std::string& name) {
+	ThreadInfo& thread = CurrentThread();
+	thread.name = name;
+	// renamed threads announce themselves again
+	thread.generation = -1;
+}
+
+void Trace::Span(const char* name, const char* category, Clock::time_point start, Clock::time_point end,
+	int frame, int iteration) {
+	ThreadInfo& thread = CurrentThread();
+	TraceFile& f = File();
+	std::lock_guard<std::mutex> guard(f.lock);
+	if (!f.file) {
+		return;
+	}
+	DeclareThread(f, thread);
+	// microseconds since the trace was opened, spans from before that are clipped
+	double ts = std::chrono::duration<double, std::micro>(start - f.origin).count();
+	double dur = std::chrono::duration<double, std::micro>(end - start).count();
+	if (ts < 0.0) {
+		dur += ts;
+		ts = 0.0;
+	}
+	char event[512];
+	int length = snprintf(event, sizeof(event),
+		"{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+		name, category, thread.id, ts, dur < 0.0 ? 0.0 : dur);
+	if (frame >= 0 || iteration >= 0) {
+		length += snprintf(event + length, sizeof(event) - length, ",\"args\":{");
+		if (frame >= 0) {
+			length += snprintf(event + length, sizeof(event) - length, "\"frame\":%d%s", frame, iteration >= 0 ? "," : "");
+		}
+		if (iteration >= 0) {
+			length += snprintf(event + length, sizeof(event) - length, "\"iteration\":%d", iteration);
+		}
+		length += snprintf(event + length, sizeof(event) - length, "}");
+	}
+	snprintf(event + length, sizeof(event) - length, "}");
+	f.Append(event);
+}
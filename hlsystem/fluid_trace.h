@@ -0,0 +1,66 @@
+#ifndef DEF_FLUID_TRACE
+	#define DEF_FLUID_TRACE
+
+	#include <atomic>
+	#include <chrono>
+	#include <string>
+
+	// trace event json for chrome://tracing or ui.perfetto.dev. off until a file
+	// is opened, H2O_TRACE=<path> in the environment opens one at startup.
+	// events stream out as a json array, a trace cut short by a crash still loads
+	class Trace {
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		// starts a new trace file, closing any open one. false if it can't be created
+		static bool Open(const std::string& path);
+		static void Close();
+		static bool Enabled() { return enabled.load(std::memory_order_relaxed); }
+		static std::string Path();
+
+		// frame the solver is working on, spans default to it
+		static void SetFrame(int frame) { frame_.store(frame, std::memory_order_relaxed); }
+		static int Frame() { return frame_.load(std::memory_order_relaxed); }
+		// label for the calling thread in the viewer
+		static void NameThread(const std::string& name);
+
+		// one complete span, frame and iteration are left out when negative
+		static void Span(const char* name, const char* category, Clock::time_point start, Clock::time_point end,
+			int frame, int iteration);
+
+	private:
+		static std::atomic<bool> enabled;
+		static std::atomic<int> frame_;
+	};
+
+	// records the scope it lives in as one span, costs a flag check while tracing is off
+	class TraceSpan {
+	public:
+		TraceSpan(const char* name, const char* category, int frame = Trace::Frame(), int iteration = -1) :
+			name(name),
+			category(category),
+			frame(frame),
+			iteration(iteration),
+			active(Trace::Enabled())
+		{
+			if (active) {
+				start = Trace::Clock::now();
+			}
+		}
+		~TraceSpan() {
+			if (active) {
+				Trace::Span(name, category, start, Trace::Clock::now(), frame, iteration);
+			}
+		}
+		TraceSpan(const TraceSpan&) = delete;
+		TraceSpan& operator=(const TraceSpan&) = delete;
+
+	private:
+		const char* name;
+		const char* category;
+		int frame;
+		int iteration;
+		bool active;
+		Trace::Clock::time_point start;
+	};
+#endif